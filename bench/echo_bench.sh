@@ -0,0 +1,29 @@
+#!/bin/bash
+# Description: Utility-heavy throughput - lines/sec for a script shaped like p3testscript-1: mostly echo,
+#   with pwd, test, printf and redirected echo mixed in
+# Usage: bench/echo_bench.sh SMALLSH [OLD_SMALLSH] [LINES]
+
+new=$(realpath "${1:?usage: $0 SMALLSH [OLD_SMALLSH] [LINES]}") || exit 1
+old=${2:+$(realpath "$2")}
+lines=${3:-20000}
+dir=$(mktemp -d)
+script=$dir/script
+trap 'rm -rf "$dir"' EXIT
+. "$(dirname "$0")/timing.sh"
+run_dir=$dir
+
+awk -v n="$lines" -v d="$dir" 'BEGIN {
+    for (i = 1; i < n; i++) {
+        if (i % 10 == 0)      print "echo line " i " > " d "/out";
+        else if (i % 10 == 3) print "pwd";
+        else if (i % 10 == 5) print "test -f " d "/out";
+        else if (i % 10 == 7) print "printf %s-%d\\n item " i;
+        else if (i % 10 == 9) print "echo";
+        else                  print "echo --------------------";
+    }
+    print "exit";
+}' > "$script"
+
+echo "script: $lines lines"
+[ -n "$old" ] && timed "old script" "$lines" lines "$old" "$script"
+timed "new script" "$lines" lines "$new" "$script"
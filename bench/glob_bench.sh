@@ -0,0 +1,28 @@
+#!/bin/bash
+# Description: Pathname expansion over a large directory - commands/sec for `echo PATTERN` run in the shell,
+#   the first one reading the directory and the rest served from the listing cache, against `find -name`
+# Usage: bench/glob_bench.sh SMALLSH [OLD_SMALLSH] [FILES] [RUNS]
+
+new=$(realpath "${1:?usage: $0 SMALLSH [OLD_SMALLSH] [FILES] [RUNS]}") || exit 1
+old=${2:+$(realpath "$2")}
+files=${3:-200000}
+runs=${4:-200}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+. "$(dirname "$0")/timing.sh"
+
+mkdir "$dir/data"
+(cd "$dir/data" && seq -f 'f%g.log' 1 "$files" | xargs touch && seq -f 'f%g.txt' 1 $((files / 10)) | xargs touch)
+# a listing read within a second of the directory's last change is not reused
+sleep 2
+
+for ((i = 0; i < runs; i++)); do echo 'echo f*777.log'; done > "$dir/glob"
+echo exit >> "$dir/glob"
+for ((i = 0; i < runs; i++)); do echo 'find . -name f*777.log'; done > "$dir/find"
+echo exit >> "$dir/find"
+
+echo "$((files + files / 10)) files, $runs commands"
+run_dir=$dir/data
+[ -n "$old" ] && run_input=$dir/find timed "old find" "$runs" commands "$old"
+run_input=$dir/find timed "new find" "$runs" commands "$new"
+run_input=$dir/glob timed "new glob" "$runs" commands "$new"
@@ -0,0 +1,35 @@
+#!/bin/bash
+# Description: Compiled control flow - iterations/sec of nested for loops (1M iterations by default) whose body
+#   runs builtins, against the same body unrolled into one line per command
+# Usage: bench/loop_bench.sh SMALLSH [OLD_SMALLSH] [LEVELS]
+#   LEVELS nested loops over 0-9 give 10^LEVELS iterations; OLD_SMALLSH runs only the unrolled script
+
+new=${1:?usage: $0 SMALLSH [OLD_SMALLSH] [LEVELS]}
+old=$2
+levels=${3:-6}
+iters=$((10 ** levels))
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+. "$(dirname "$0")/timing.sh"
+
+# for v1 in 0 1 ... 9; do for v2 in ...; do test $vN -lt 5; true; done ... done
+awk -v n="$levels" 'BEGIN {
+    for (i = 1; i <= n; i++) print "for v" i " in 0 1 2 3 4 5 6 7 8 9; do";
+    print "test $v" n " -lt 5";
+    print "true";
+    for (i = 1; i <= n; i++) print "done";
+    print "exit";
+}' > "$dir/loop"
+
+awk -v n="$iters" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        print "test " i % 10 " -lt 5";
+        print "true";
+    }
+    print "exit";
+}' > "$dir/unrolled"
+
+echo "$iters iterations, 2 builtins each"
+[ -n "$old" ] && run_input=$dir/unrolled timed "old unrolled" "$iters" iterations "$old"
+run_input=$dir/unrolled timed "new unrolled" "$iters" iterations "$new"
+run_input=$dir/loop timed "new loop" "$iters" iterations "$new"
@@ -0,0 +1,96 @@
+// Description: Parser microbenchmark - ns/line and heap allocations/line for parseInput
+// Build: gcc -O2 bench/parse_bench.c -o parse_bench
+// Usage: ./parse_bench [-n iterations]
+
+// count every heap allocation the shell makes, the shell's own includes are already guarded by these
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+long allocCount = 0;
+
+void *countMalloc(size_t size) {
+    allocCount++;
+    return malloc(size);
+}
+
+void *countCalloc(size_t n, size_t size) {
+    allocCount++;
+    return calloc(n, size);
+}
+
+void *countRealloc(void *p, size_t size) {
+    allocCount++;
+    return realloc(p, size);
+}
+
+char *countStrdup(const char *s) {
+    allocCount++;
+    return strdup(s);
+}
+
+#define malloc(size) countMalloc(size)
+#define calloc(n, size) countCalloc(n, size)
+#define realloc(p, size) countRealloc(p, size)
+#define strdup(s) countStrdup(s)
+
+// pull in the shell itself so the real parser is measured
+#define main smallsh_main
+#include "../smallsh.c"
+#undef main
+
+#include <time.h>
+
+// representative lines - plain commands, redirection, pipelines, $$ and long argument lists
+char *lines[] = {
+    "ls -la /tmp",
+    "wc < junk > junk2",
+    "cat file | grep pattern | sort | uniq -c",
+    "mkdir testdir$$",
+    "sleep 100 &",
+    "gcc -O2 -Wall -Wextra -o smallsh smallsh.c -lrt -DNDEBUG -I include -I src -L lib",
+    "echo a b c d e f g h i j k l m n o p q r s t u v w x y z 0 1 2 3 4 5 6 7 8 9",
+};
+
+int main(int argc, char *argv[]) {
+    long n = 200000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            n = atol(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int nlines = sizeof(lines) / sizeof(lines[0]);
+    char line[4096];
+    struct sh_pipeline pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    long i;
+
+    // warm up so one-time growth is not counted as steady state
+    for (i = 0; i < nlines; i++) {
+        strcpy(line, lines[i]);
+        parseInput(line, &pipeline);
+        freePipeline(&pipeline);
+    }
+
+    allocCount = 0;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < n; i++) {
+        // the parser may cut words out of the line in place, give it a fresh copy like the reader does
+        strcpy(line, lines[i % nlines]);
+        parseInput(line, &pipeline);
+        freePipeline(&pipeline);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("lines: %ld\n", n);
+    printf("ns/line: %.1f\n", ns / n);
+    printf("allocations/line: %.2f\n", (double)allocCount / n);
+    return 0;
+}
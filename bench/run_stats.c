@@ -0,0 +1,109 @@
+// Description: Run one smallsh on one script and report wall time, peak RSS and (with -s) the shell's own
+//   syscall count, for bench/suite.sh
+// Build: gcc -O2 bench/run_stats.c -o bench/run_stats
+// Usage: ./run_stats [-s] SMALLSH SCRIPT
+//   prints "wall_seconds peak_rss_kb syscalls" on one line, syscalls is -1 without -s
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+double nowSec(void) {
+    /*
+    Monotonic clock reading
+    :retrn: seconds
+    */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long countSyscalls(pid_t pid, int *status, struct rusage *usage) {
+    /*
+    Step a traced child from syscall stop to syscall stop until it exits, children it forks are not traced
+    :param: traced child (stopped), where to store its final wait status and rusage
+    :retrn: syscalls made, entry and exit stops count as one
+    */
+    long stops = 0;
+    int sig = 0;
+
+    ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+    while (1) {
+        ptrace(PTRACE_SYSCALL, pid, 0, sig);
+        if (wait4(pid, status, 0, usage) == -1 || WIFEXITED(*status) || WIFSIGNALED(*status)) {
+            break;
+        }
+        sig = 0;
+        if (WSTOPSIG(*status) == (SIGTRAP | 0x80)) {
+            stops++;
+        } else if (WSTOPSIG(*status) != SIGTRAP) {
+            // pass real signals on, the SIGTRAP after exec is ptrace's own
+            sig = WSTOPSIG(*status);
+        }
+    }
+    return stops / 2;
+}
+
+int main(int argc, char *argv[]) {
+    int trace = 0;
+    int status;
+    long syscalls = -1;
+    struct rusage usage;
+
+    if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+        trace = 1;
+        argv++;
+        argc--;
+    }
+    if (argc != 3) {
+        fprintf(stderr, "usage: run_stats [-s] SMALLSH SCRIPT\n");
+        return 1;
+    }
+
+    int in = open(argv[2], O_RDONLY);
+    int out = open("/dev/null", O_WRONLY);
+    if (in == -1 || out == -1) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    double start = nowSec();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // own session, so nothing the shell signals at exit can reach the harness
+        setsid();
+        dup2(in, 0);
+        dup2(out, 1);
+        dup2(out, 2);
+        if (trace == 1) {
+            ptrace(PTRACE_TRACEME, 0, 0, 0);
+            raise(SIGSTOP);
+        }
+        execl(argv[1], argv[1], (char *)NULL);
+        _exit(127);
+    }
+
+    if (trace == 1) {
+        waitpid(pid, &status, 0);
+        syscalls = countSyscalls(pid, &status, &usage);
+    } else {
+        wait4(pid, &status, 0, &usage);
+    }
+    double wall = nowSec() - start;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        fprintf(stderr, "run_stats: cannot run %s\n", argv[1]);
+        return 1;
+    }
+
+    // peak RSS of the shell itself, wait4 reports only the child waited for
+    printf("%.4f %ld %ld\n", wall, usage.ru_maxrss, syscalls);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#!/bin/bash
+# Description: Input-path throughput - lines/sec for a script of builtins, comments and trivial commands
+# Usage: bench/script_bench.sh SMALLSH [OLD_SMALLSH] [LINES]
+#   SMALLSH is run both as 'smallsh script' and 'smallsh < script', OLD_SMALLSH (e.g. a build of an
+#   earlier commit) only through stdin
+
+new=${1:?usage: $0 SMALLSH [OLD_SMALLSH] [LINES]}
+old=$2
+lines=${3:-100000}
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+. "$(dirname "$0")/timing.sh"
+
+# mostly in-shell work, with one trivial external command per 100 lines
+awk -v n="$lines" 'BEGIN {
+    for (i = 1; i < n; i++) {
+        if (i % 100 == 0)     print "true";
+        else if (i % 4 == 0)  print "# comment line " i;
+        else if (i % 4 == 1)  print "status";
+        else if (i % 4 == 2)  print "";
+        else                  print "cd .";
+    }
+    print "exit";
+}' > "$script"
+
+echo "script: $lines lines"
+[ -n "$old" ] && run_input=$script timed "old < script" "$lines" lines "$old"
+run_input=$script timed "new < script" "$lines" lines "$new"
+timed "new script" "$lines" lines "$new" "$script"
@@ -0,0 +1,108 @@
+// Description: Compare smallsh's fork and posix_spawn launch engines - commands/sec and p50/p99 spawn latency
+// Build: gcc -O2 bench/spawn_bench.c -o spawn_bench
+// Usage: ./spawn_bench [-n iterations] [-m heap MB] [command [args...]]
+
+// pull in the shell itself so the real launch code is measured
+#define main smallsh_main
+#include "../smallsh.c"
+#undef main
+
+#include <time.h>
+
+double nowUsec(void) {
+    /*
+    Monotonic clock reading
+    :retrn: microseconds
+    */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int cmpDouble(const void *a, const void *b) {
+    /*
+    qsort comparator for doubles
+    */
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void runEngine(char *engine, struct sh_command *cmd, int n, double *samples) {
+    /*
+    Launch and reap the command n times with one engine, then print its results
+    :param: engine name, command struct, iteration count, scratch array of n doubles
+    */
+    int i;
+    int status;
+    setSpawnMode(engine);
+
+    double start = nowUsec();
+    for (i = 0; i < n; i++) {
+        double t0 = nowUsec();
+        pid_t pid = launchCommand(cmd);
+        samples[i] = nowUsec() - t0;
+        if (pid == -1) {
+            exit(1);
+        }
+        waitpid(pid, &status, 0);
+    }
+    double total = nowUsec() - start;
+
+    qsort(samples, n, sizeof(double), cmpDouble);
+    printf("%-6s %12.0f %12.1f %12.1f\n", engine, n / (total / 1e6), samples[n / 2], samples[(n * 99) / 100]);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    int n = 2000;
+    long heapMB = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+        switch (opt) {
+            case 'n':
+                n = atoi(optarg);
+                break;
+            case 'm':
+                heapMB = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n iterations] [-m heap MB] [command [args...]]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (n < 1) {
+        n = 1;
+    }
+
+    // dirty a heap so fork has page tables to copy, like a long-lived shell
+    if (heapMB > 0) {
+        char *ballast = malloc(heapMB << 20);
+        memset(ballast, 1, heapMB << 20);
+    }
+
+    // build the command the same way parseInput would
+    struct sh_command cmd;
+    clearCommand(&cmd);
+    char *defaultArgs[] = {"true", NULL};
+    if (optind < argc) {
+        cmd.args = &argv[optind];
+        cmd.argc = argc - optind;
+    } else {
+        cmd.args = defaultArgs;
+        cmd.argc = 1;
+    }
+    cmd.command = cmd.args[0];
+
+    setupSignals();
+    double *samples = malloc(n * sizeof(double));
+
+    printf("command: %s, iterations: %d, heap: %ld MB\n", cmd.command, n, heapMB);
+    printf("%-6s %12s %12s %12s\n", "engine", "cmds/sec", "p50 usec", "p99 usec");
+    runEngine("fork", &cmd, n, samples);
+    runEngine("posix", &cmd, n, samples);
+
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#!/bin/bash
+# Description: End-to-end benchmark suite - drives smallsh through synthetic workloads and reports
+#   commands/sec, wall time, peak RSS and the shell's own syscall count, optionally against a second binary
+# Usage: bench/suite.sh SMALLSH [OLD_SMALLSH]   (or: make bench OLD=./smallsh.old)
+#   SCALE=n multiplies every workload's size, RUNS=n sets how many timed runs are taken (best is kept)
+# Scripts are fed on stdin so builds that predate script mode can be compared too
+
+new=$(realpath "${1:?usage: $0 SMALLSH [OLD_SMALLSH]}") || exit 1
+old=${2:+$(realpath "$2")}
+scale=${SCALE:-1}
+runs=${RUNS:-3}
+here=$(cd "$(dirname "$0")" && pwd)
+stats=$here/run_stats
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+if [ ! -x "$stats" ] || [ "$stats.c" -nt "$stats" ]; then
+    gcc -O2 "$here/run_stats.c" -o "$stats" || exit 1
+fi
+
+# workload NAME AWK-BODY - writes $dir/NAME with n commands, the body prints one line for i
+workload() {
+    awk -v n="$2" -v d="$dir" "BEGIN { for (i = 1; i <= n; i++) { $3 } print \"exit\" }" > "$dir/$1"
+}
+
+echo "some input for the redirection workload" > "$dir/in"
+# external commands by path, so builds with in-process utilities still fork
+workload spawn $((2000 * scale)) 'print "/bin/true"'
+workload redirect $((1000 * scale)) 'if (i % 2) print "wc -c < " d "/in > " d "/out"; else print "cat < " d "/in > " d "/out2"'
+workload bgfanout $((1000 * scale)) 'print "/bin/true &"; if (i % 100 == 0) print "sleep 0.01"'
+workload longargs $((1000 * scale)) 'line = (i % 10 == 0) ? "/bin/true" : "status";
+    for (j = 0; j < 300; j++) line = line " argument-number-" j; print line'
+workload comments $((200000 * scale)) 'if (i % 3 == 0) print ""; else print "# comment line " i " with some words after it"'
+
+# measure LABEL BINARY WORKLOAD - best wall time of $runs runs, peak RSS and syscalls from a traced run
+measure() {
+    local best= rss= sys= wall r
+    for ((r = 0; r < runs; r++)); do
+        read -r wall rss _ < <(cd "$dir" && "$stats" "$2" "$dir/$3")
+        if [ -z "$best" ] || awk -v a="$wall" -v b="$best" 'BEGIN { exit !(a < b) }'; then
+            best=$wall
+        fi
+    done
+    read -r _ _ sys < <(cd "$dir" && "$stats" -s "$2" "$dir/$3")
+    local cmds=$(($(wc -l < "$dir/$3")))
+    awk -v w="$3" -v l="$1" -v n="$cmds" -v t="$best" -v m="$rss" -v s="$sys" 'BEGIN {
+        printf "%-10s %-4s %8d %9.3f %12.0f %9d %10d %8.1f\n", w, l, n, t, n / t, m, s, s / n }'
+    # remembered for the comparison line
+    last=$best
+}
+
+printf "%-10s %-4s %8s %9s %12s %9s %10s %8s\n" workload bin cmds "wall(s)" cmds/sec "rss(KB)" syscalls sys/cmd
+for w in spawn redirect bgfanout longargs comments; do
+    if [ -n "$old" ]; then
+        measure old "$old" $w
+        before=$last
+    fi
+    measure new "$new" $w
+    if [ -n "$old" ]; then
+        awk -v a="$before" -v b="$last" 'BEGIN { printf "%-10s speedup %.2fx\n", "", a / b }'
+    fi
+done
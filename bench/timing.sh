@@ -0,0 +1,16 @@
+# Description: Timing helper sourced by the bench/*_bench.sh scripts
+# Usage: . "$(dirname "$0")/timing.sh"; timed LABEL COUNT UNIT COMMAND...
+#   Runs COMMAND once with its output discarded and prints the wall time and COUNT/sec. The command runs in
+#   $run_dir when set and reads $run_input when set, /dev/null otherwise - never the terminal, so the shell
+#   under test doesn't take it for an interactive session and turn on job control
+
+timed() {
+    local label=$1 count=$2 unit=$3
+    shift 3
+    local t0=$EPOCHREALTIME
+    # scripts end in exit, whatever status the shell leaves with is not the benchmark's
+    (cd "${run_dir:-.}" && "$@" < "${run_input:-/dev/null}") > /dev/null 2>&1
+    local t1=$EPOCHREALTIME
+    awk -v l="$label" -v n="$count" -v u="$unit" -v a="$t0" -v b="$t1" \
+        'BEGIN { printf "%-28s %10.3f s %12.1f %s/sec\n", l, b - a, n / (b - a), u }'
+}
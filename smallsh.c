@@ -3,6 +3,7 @@
 // Description: Design a small shell that performs a subset of bash features
 
 // include necessary packages
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,592 +12,7662 @@
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <spawn.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <sched.h>
+
+// launch engines for external commands
+#define SPAWN_FORK 0
+#define SPAWN_POSIX 1
+
+// initial size of the input line buffer
+#define READER_BUFSIZE 65536
+// job states
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+#define JOB_DONE 2
+// waiting for a free background slot (maxjobs)
+#define JOB_QUEUED 3
+// finished background jobs kept for jobs/wait
+#define MAX_DONE_JOBS 64
+
+// word slots the scratch argv starts with, it grows up to what ARG_MAX allows
+#define ARGS_INITIAL 512
+// longest single argument execve takes (MAX_ARG_STRLEN, 32 pages)
+#define ARG_STRLEN_MAX (32 * 4096)
+// most redirections on one command
+#define MAX_REDIRECTS 32
+// smallest block the parse arena allocates
+#define ARENA_BLOCK 16384
+
+// resource limits one command can set, and the ioprio_set encoding (linux/ioprio.h)
+#define MAX_LIMITS 8
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+// buckets in the command path cache
+#define HASH_BUCKETS 64
+// directory listings kept for pathname expansion, and the getdents64 buffer size
+#define GLOB_CACHE_DIRS 64
+#define GLOB_BATCH 262144
+
+// phases --trace records for the stats histograms
+#define TRACE_PARSE 0
+#define TRACE_LOOKUP 1
+#define TRACE_FORK 2
+#define TRACE_EXEC 3
+#define TRACE_WAIT 4
+#define TRACE_BUILTIN 5
+#define TRACE_QUEUE 6
+#define TRACE_PHASES 7
+// log-linear histogram - 8 buckets per power of two of nanoseconds
+#define HIST_BUCKETS 512
+
+// redirection kinds - [n]<file, [n]>file, [n]>>file, [n]>&m / [n]<&m, and &>file / &>>file while parsing
+#define REDIR_IN 0
+#define REDIR_OUT 1
+#define REDIR_APPEND 2
+#define REDIR_DUP 3
+#define REDIR_BOTH 4
+#define REDIR_BOTH_APPEND 5
+
+// compiled command kinds
+#define NODE_SIMPLE 0
+#define NODE_IF 1
+#define NODE_WHILE 2
+#define NODE_UNTIL 3
+#define NODE_FOR 4
+#define NODE_FUNCTION 5
+// cmd && cmd, cmd || cmd
+#define NODE_AND 6
+#define NODE_OR 7
+// deepest nesting of function calls while running compiled commands
+#define MAX_DEPTH 128
+
+// what an epoll event in server mode belongs to
+#define TAG_LISTEN 0
+#define TAG_CHILD 1
+#define TAG_CLIENT 2
+#define TAG_OUTPUT 3
+#define TAG_DEADLINE 4
 
 
 // global vars
-pid_t sigCaught = -2;
-int redirInput = 0;
-int redirOutput = 0;
 int to_exit = 0;
 int allow_bg = 0;
 int statusVar = 0;
-char sh_input[2049] = {'\0'};
+// a $(...) ran while the current command's words were expanded, an assignment keeps its status
+int substituted = 0;
+// forked copies of the shell (lists, substitutions, parallel tasks) leave without the farewell
+int inCopy = 0;
+int spawnMode = SPAWN_FORK;
+int jobControl = 0;
+pid_t shellPGID = 0;
+// SIGCHLD arrives through this descriptor instead of a handler
+int childFD = -1;
+// signal mask the shell started with, children get it back
+sigset_t shellMask;
+int showPrompt = 1;
+char *sh_input = NULL;
+
+// block of the parse arena
+struct arena_block {
+    struct arena_block *next;
+    size_t cap;
+    size_t used;
+    char data[];
+};
+
+// bump allocator for everything one line parses into - blocks are kept and reused, reset is O(1)
+struct arena {
+    struct arena_block *head;
+    struct arena_block *cur;
+};
+
+// one redirection of a command, applied in the order written
+struct sh_redirect {
+    int fd;
+    int kind;
+    // file name, or the descriptor number (or -) to copy for REDIR_DUP
+    char *target;
+    struct sh_redirect *next;
+};
+
+// where a command's processes run - CPUs, niceness, I/O priority and resource limits, applied before exec
+struct sh_placement {
+    int hasCpus;
+    cpu_set_t cpus;
+    int hasNice;
+    int nice;
+    // ioprio_set value, 0 when unset
+    int ioprio;
+    int limitCount;
+    int limitResource[MAX_LIMITS];
+    rlim_t limitValue[MAX_LIMITS];
+};
 
-// input command structure
+// input command structure - one stage of a pipeline
 struct sh_command {
     char *command;
-    char *args[513];
-    char *inputFile;
-    char *outputFile;
+    char **args;
+    int argc;
+    struct sh_redirect *redirects;
+    struct sh_redirect *lastRedirect;
+    char *execPath;
+    int background;
+    int pipeIn;
+    int pipeOut;
+    pid_t pgid;
+    // --trace timestamps (monotonic ns) and the child's pre-exec pipe
+    long long lookupStart;
+    long long lookupEnd;
+    long long forkStart;
+    long long forkEnd;
+    long long preExec;
+    int traceFD;
+    // descriptor for stderr, -1 to leave it alone
+    int errFD;
+    // placement prefixes, NULL for none
+    struct sh_placement *place;
+    // prefixed with timeout or placement - a utility builtin runs as a process too
+    int external;
+    struct sh_command *next;
+};
+
+// a line of input - stages connected by pipes, run together as one job
+struct sh_pipeline {
+    struct sh_command *first;
+    struct sh_command *last;
+    int count;
+    int background;
+    int timed;
+    char *text;
+    int captureFD;
+    // captureFD takes every stage's stderr too
+    int captureErr;
+    int inputFD;
+    // compiled with $ words left for run time
+    int deferred;
+    // timeout prefix in seconds (-1 for none, even over the default deadline) and its SIGTERM to SIGKILL grace
+    double timeout;
+    double grace;
+    long long parseStart;
+    long long parseEnd;
+    struct arena arena;
+};
+
+// newest bytes a background job wrote, oldest first from start
+struct sh_ring {
+    char *data;
+    size_t size;
+    size_t start;
+    size_t len;
+    // bytes overwritten once the ring was full
+    size_t dropped;
+    // written to since the output builtin last showed it
+    int unread;
+};
+
+// job table entry - every stage of a pipeline shares the job's process group
+struct sh_job {
+    int id;
+    pid_t pgid;
+    pid_t *pids;
+    int count;
+    int live;
+    pid_t lastPID;
+    int status;
+    int state;
+    int background;
+    int timed;
+    char *text;
+    struct timespec start;
+    struct timespec end;
+    struct rusage usage;
+    // --trace record so far, finished when the job is reaped
+    char *trace;
+    // queued & job - its expanded pipeline (or compiled && / || list) until a slot frees up, when it was
+    // submitted, and whether it waited
+    struct sh_pipeline *pending;
+    struct sh_node *pendingList;
+    struct timespec submitted;
+    int queued;
+    // bgoutput capture - read end of the job's stdout/stderr pipe (0 once closed) and what came out of it
+    int outFD;
+    struct sh_ring output;
+    // monotonic nanoseconds the job gets SIGTERM at (0 for no deadline), then SIGKILL at once it has timed out
+    long long deadline;
+    long long killAt;
+    double timeout;
+    double grace;
+    int timedOut;
+    struct sh_job *next;
+};
+
+struct sh_job *jobList = NULL;
+// captured output of finished jobs, oldest first - unread output is kept until the output builtin shows it, and
+// up to MAX_DONE_JOBS more after that, all within KEPT_OUTPUT_MAX bytes
+#define KEPT_OUTPUT_MAX (16 << 20)
+struct sh_output {
+    int id;
+    pid_t pgid;
+    struct sh_ring ring;
+    struct sh_output *next;
+};
+struct sh_output *keptOutput = NULL;
+size_t keptBytes = 0;
+int doneJobs = 0;
+// most & jobs running at once, 0 for no limit - the rest wait in the queue in order
+int maxJobs = 0;
+int queuedJobs = 0;
+// what happens to & job output without a redirection - discarded, kept in a ring per job, or kept and saved to
+// spillDir when the job ends
+#define BGOUT_DISCARD 0
+#define BGOUT_CAPTURE 1
+#define BGOUT_SPILL 2
+int bgOutput = BGOUT_DISCARD;
+size_t ringSize = 65536;
+char *spillDir = NULL;
+// job deadlines - one timerfd in the wait loop, armed for the nearest SIGTERM or SIGKILL (armedAt, 0 when idle)
+#define KILL_GRACE 2.0
+#define TIMEOUT_STATUS 124
+int deadlineFD = -1;
+long long armedAt = 0;
+// deadline every job gets without a timeout prefix, 0 for none
+double defaultDeadline = 0;
+// the last status came from a job that ran out of time
+int statusTimedOut = 0;
+// a background notice was printed since the last prompt
+int noticePrinted = 0;
+
+// buffered line reader over a file descriptor, or over a fixed string when fd is -1
+struct line_reader {
+    int fd;
+    char *buf;
+    size_t start;
+    size_t end;
+    size_t cap;
+    int eof;
+};
+
+// where the shell reads its commands
+struct line_reader *shellInput = NULL;
+
+// command path cache entry - maps a bare command name to its absolute path
+struct path_entry {
+    char *name;
+    char *path;
+    int hits;
+    struct path_entry *next;
+};
+
+struct path_entry *pathTable[HASH_BUCKETS] = {NULL};
+char *hashedPATH = NULL;
+int hashHits = 0;
+int hashMisses = 0;
+
+// directory listing kept for pathname expansion, reused while the directory's inode and mtime are unchanged
+struct dir_listing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    // read long enough after the last change for the mtime to be relied on
+    int trusted;
+    // being walked by a pattern, neither evicted nor read again meanwhile
+    int busy;
+    // sorted names, packed end to end in storage, and their lengths (a name is at most 255 bytes)
+    char **names;
+    unsigned char *lengths;
+    int count;
+    char *storage;
+    struct dir_listing *next;
+};
+
+// most recently used first
+struct dir_listing *dirCache = NULL;
+
+// record as getdents64 returns it
+struct sh_dirent {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// placement every & job gets (bgplace), and round-robin CPU pinning of & jobs
+struct sh_placement bgPlace;
+int bgPlaced = 0;
+int spreadJobs = 0;
+int nextCPU = -1;
+
+// resources the limit prefix knows
+struct limit_name {
+    char *name;
+    int resource;
+};
+
+struct limit_name limitNames[] = {
+    {"as", RLIMIT_AS},
+    {"core", RLIMIT_CORE},
+    {"cpu", RLIMIT_CPU},
+    {"data", RLIMIT_DATA},
+    {"fsize", RLIMIT_FSIZE},
+    {"memlock", RLIMIT_MEMLOCK},
+    {"nofile", RLIMIT_NOFILE},
+    {"nproc", RLIMIT_NPROC},
+    {"rss", RLIMIT_RSS},
+    {"stack", RLIMIT_STACK},
+    {NULL, 0}
+};
+
+// process group every job joins, set in the forked shell running a backgrounded && / || list so the list is one job
+pid_t listGroup = 0;
+
+// logical working directory ($PWD), kept up to date by cd instead of asked for with getcwd
+char *logicalPWD = NULL;
+// pushd/popd stack, top last
+char **dirStack = NULL;
+int dirCount = 0;
+int dirCap = 0;
+
+// a CDPATH lookup that found a directory, with its inode to tell when it has been replaced
+struct cdpath_entry {
+    char *cdpath;
+    char *name;
+    char *resolved;
+    dev_t dev;
+    ino_t ino;
+    struct cdpath_entry *next;
+};
+
+struct cdpath_entry *cdpathCache = NULL;
+
+// $$ text, formatted on first use
+char pidString[16];
+size_t pidLen = 0;
+// PID behind $!
+pid_t lastBgPID = 0;
+
+// control flow compiled once - simple commands keep a parsed pipeline whose $ words are expanded each run
+struct sh_node {
+    int kind;
+    struct sh_pipeline *command;
+    // if/while/until condition, then/do/function body, else branch (elif is a nested if)
+    struct sh_node *cond;
+    struct sh_node *body;
+    struct sh_node *elseBody;
+    // for variable or function name
+    char *name;
+    // for word list, NULL-terminated, NULL means the positional parameters
+    char **words;
+    int wordsDeferred;
+    // for NAME=word entries, built at compile time when no word holds $
+    char **entries;
+    // && / || list ending in &, and its text for the job table
     int background;
+    char *text;
+    struct sh_node *next;
+};
+
+// defined function
+struct sh_function {
+    char *name;
+    struct sh_node *body;
+    struct sh_function *next;
+};
+
+// lines pulled in while compiling a multi-line command
+struct compile_src {
+    struct line_reader *reader;
+    struct arena *arena;
+    // rest of the current line, and the rest of a segment after a keyword
+    char *rest;
+    char *pushed;
+    // && or || (NODE_AND, NODE_OR) after the segment just returned, 0 for ; & or end of line
+    int joiner;
+    int error;
+};
+
+struct sh_function *functions = NULL;
+// set once a function is defined or a list job is queued, compiled commands have to outlive the line
+int keepCompiled = 0;
+// positional parameters of the running function
+char **posArgs = NULL;
+int posCount = 0;
+// $0, the script being run or the shell itself
+char *shellName = "smallsh";
+// running loops and function calls, and break/continue/return on their way out
+int loopDepth = 0;
+int funcDepth = 0;
+int breakLevels = 0;
+int continueLevels = 0;
+int returning = 0;
+// parseInput leaves $ words for run time while compiling
+int compiling = 0;
+extern char **environ;
+// one pipeline per nesting level to expand compiled commands into
+struct sh_pipeline scratch[MAX_DEPTH];
+int execDepth = 0;
+
+// /dev/null, opened once and dup2'd into children
+int devNull = -1;
+
+// --trace output, NULL when tracing is off
+FILE *traceFile = NULL;
+long traceSeq = 0;
+
+// latency samples of one phase
+struct histogram {
+    long count;
+    long long max;
+    long buckets[HIST_BUCKETS];
+};
+
+struct histogram phaseHist[TRACE_PHASES];
+char *phaseNames[TRACE_PHASES] = {"parse", "lookup", "fork", "pre_exec", "wait", "builtin", "queue"};
+
+// server mode - epoll user data, names the descriptor and its client
+struct server_tag {
+    int kind;
+    struct sh_client *client;
 };
 
+// server mode - one connection, its requests run one after another
+struct sh_client {
+    int fd;
+    // read end of the running request's stdout, -1 once it hit end of file
+    int outFD;
+    // this client's $?, and whether it came from a request that timed out
+    int status;
+    int timedOut;
+    int closing;
+    struct sh_job *job;
+    struct sh_pipeline pipeline;
+    struct server_tag sockTag;
+    struct server_tag outTag;
+    // request bytes not run yet
+    char *in;
+    size_t inLen;
+    size_t inCap;
+    // stdout of the running request
+    char *out;
+    size_t outLen;
+    size_t outCap;
+    // reply being sent
+    char *reply;
+    size_t replyLen;
+    size_t replyCap;
+    size_t replySent;
+    struct sh_client *next;
+};
+
+struct sh_client *serverClients = NULL;
+// memfd the shell's own stdout goes to while it handles a request
+int serverScratch = -1;
+
+// words of the stage being parsed, copied into the arena once the stage is complete
+char **argScratch = NULL;
+int argCap = 0;
+// bytes of argv and environment execve takes (ARG_MAX), and the most words that leaves room for
+long argMax = 0;
+int argLimit = 0;
+
+long argMaxBytes(void) {
+    /*
+    The kernel's ARG_MAX, asked for once
+    :retrn: bytes
+    */
+    if (argMax == 0) {
+        argMax = sysconf(_SC_ARG_MAX);
+        if (argMax <= 0) {
+            argMax = 131072;
+        }
+        // every word costs execve at least its pointer and a terminating byte
+        argLimit = argMax / (sizeof(char *) + 1);
+    }
+    return argMax;
+}
+
+int argRoom(int argCount) {
+    /*
+    Make sure argScratch has a slot for one more word and the NULL after it, doubling it as needed
+    :param: words collected so far
+    :retrn: 0, -1 after printing that the command has more words than execve could take
+    */
+    if (argCount + 1 < argCap) {
+        return 0;
+    }
+    argMaxBytes();
+    if (argCount >= argLimit) {
+        printf("Too many arguments (limit %d)\n", argLimit);
+        fflush(stdout);
+        return -1;
+    }
+    argCap = argCap == 0 ? ARGS_INITIAL : argCap * 2;
+    argScratch = realloc(argScratch, argCap * sizeof(char *));
+    return 0;
+}
+
+void *arenaAlloc(struct arena *a, size_t size) {
+    /*
+    Carve memory out of the arena, moving on to (or adding) a block when the current one is full
+    :param: arena, bytes needed
+    :retrn: pointer-aligned memory, valid until the arena is reset
+    */
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    while (a->cur != NULL && a->cur->used + size > a->cur->cap) {
+        // blocks after cur are left over from earlier lines, reuse them
+        if (a->cur->next != NULL) {
+            a->cur = a->cur->next;
+            a->cur->used = 0;
+        } else {
+            break;
+        }
+    }
+    if (a->cur == NULL || a->cur->used + size > a->cur->cap) {
+        size_t cap = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        struct arena_block *b = malloc(sizeof(struct arena_block) + cap);
+        b->next = NULL;
+        b->cap = cap;
+        b->used = 0;
+        if (a->cur == NULL) {
+            a->head = b;
+        } else {
+            a->cur->next = b;
+        }
+        a->cur = b;
+    }
+    void *mem = a->cur->data + a->cur->used;
+    a->cur->used += size;
+    return mem;
+}
+
+void arenaReset(struct arena *a) {
+    /*
+    Release everything allocated from the arena at once, keeping its blocks for the next line
+    :param: arena
+    */
+    a->cur = a->head;
+    if (a->cur != NULL) {
+        a->cur->used = 0;
+    }
+}
+
+void arenaFree(struct arena *a) {
+    /*
+    Give every block of the arena back to the heap
+    :param: arena
+    */
+    struct arena_block *block = a->head;
+    while (block != NULL) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    a->head = NULL;
+    a->cur = NULL;
+}
+
+char *arenaString(struct arena *a, const char *text) {
+    /*
+    Copy a string into the arena
+    :param: arena, string
+    :retrn: copy
+    */
+    size_t len = strlen(text) + 1;
+    char *copy = arenaAlloc(a, len);
+    memcpy(copy, text, len);
+    return copy;
+}
+
 void clearCommand(struct sh_command *c) {
     /*
-    Wipes user command's allocated memory to ensure clean write
+    Wipes user command struct to ensure clean write
     :param: user command struct
     */
     memset(c, 0, sizeof(struct sh_command));
+    // no pipe connected until the pipeline is launched
+    c->pipeIn = -1;
+    c->pipeOut = -1;
+    c->traceFD = -1;
+    c->errFD = -1;
 }
 
-void freeCommand(struct sh_command *c) {
+struct sh_command *addStage(struct sh_pipeline *pipeline) {
     /*
-    Checks for memory allocations and frees them if they exist
-    :param: user command struct
+    Take a clean command struct from the arena and append it to the pipeline
+    :param: pipeline struct
+    :retrn: new stage
+    */
+    struct sh_command *c = arenaAlloc(&pipeline->arena, sizeof(struct sh_command));
+    clearCommand(c);
+    if (pipeline->last == NULL) {
+        pipeline->first = c;
+    } else {
+        pipeline->last->next = c;
+    }
+    pipeline->last = c;
+    pipeline->count++;
+    return c;
+}
+
+void freePipeline(struct sh_pipeline *pipeline) {
+    /*
+    Drop every stage of the pipeline and leave it empty - one arena reset, nothing to free per word
+    :param: pipeline struct
+    */
+    arenaReset(&pipeline->arena);
+    pipeline->first = NULL;
+    pipeline->last = NULL;
+    pipeline->count = 0;
+    pipeline->background = 0;
+    pipeline->timed = 0;
+    pipeline->text = NULL;
+    pipeline->captureFD = 0;
+    pipeline->captureErr = 0;
+    pipeline->inputFD = 0;
+    pipeline->deferred = 0;
+    pipeline->timeout = 0;
+    pipeline->grace = 0;
+    pipeline->parseStart = 0;
+    pipeline->parseEnd = 0;
+}
+
+struct sh_pipeline *clonePipeline(struct sh_pipeline *pipeline) {
+    /*
+    Copy an expanded pipeline into an arena of its own, so it outlives the line (or loop pass) it came from
+    :param: pipeline
+    :retrn: malloc'd copy, released with arenaFree and free
+    */
+    struct sh_pipeline *copy = calloc(1, sizeof(struct sh_pipeline));
+    struct sh_command *stage;
+    struct sh_redirect *r;
+    int i;
+
+    for (stage = pipeline->first; stage != NULL; stage = stage->next) {
+        struct sh_command *c = addStage(copy);
+        c->argc = stage->argc;
+        c->args = arenaAlloc(&copy->arena, (stage->argc + 1) * sizeof(char *));
+        for (i = 0; i < stage->argc; i++) {
+            c->args[i] = arenaString(&copy->arena, stage->args[i]);
+        }
+        c->args[i] = NULL;
+        c->command = c->args[0];
+        c->background = stage->background;
+        c->external = stage->external;
+        for (r = stage->redirects; r != NULL; r = r->next) {
+            struct sh_redirect *nr = arenaAlloc(&copy->arena, sizeof(struct sh_redirect));
+            *nr = *r;
+            nr->target = arenaString(&copy->arena, r->target);
+            nr->next = NULL;
+            if (c->lastRedirect == NULL) {
+                c->redirects = nr;
+            } else {
+                c->lastRedirect->next = nr;
+            }
+            c->lastRedirect = nr;
+        }
+        // stages of a pipeline share one placement
+        if (stage->place != NULL) {
+            c->place = stage == pipeline->first ? arenaAlloc(&copy->arena, sizeof(struct sh_placement))
+                                                : copy->first->place;
+            *c->place = *stage->place;
+        }
+    }
+    copy->background = pipeline->background;
+    copy->timed = pipeline->timed;
+    copy->timeout = pipeline->timeout;
+    copy->grace = pipeline->grace;
+    copy->text = arenaString(&copy->arena, pipeline->text);
+    copy->captureFD = pipeline->captureFD;
+    copy->inputFD = pipeline->inputFD;
+    copy->parseStart = pipeline->parseStart;
+    copy->parseEnd = pipeline->parseEnd;
+    return copy;
+}
+
+void appendText(struct arena *a, char **out, size_t *len, size_t *cap, const char *text, size_t n) {
+    /*
+    Append to a word being built in the arena, moving it to a block twice the size when it runs out of room
+    :param: arena, word buffer, word length, buffer capacity, text to add, text length
+    */
+    if (*len + n + 1 > *cap) {
+        size_t newCap = (*len + n + 1) * 2;
+        char *grown = arenaAlloc(a, newCap);
+        memcpy(grown, *out, *len);
+        *out = grown;
+        *cap = newCap;
+    }
+    memcpy(*out + *len, text, n);
+    *len += n;
+}
+
+char *substEnd(char *text) {
+    /*
+    Find the parenthesis closing a $( - the command inside may hold blanks and nested $(...)
+    :param: text starting at the $
+    :retrn: pointer just past the closing parenthesis, NULL when there is none
+    */
+    int depth = 0;
+    char *p;
+    for (p = text + 1; *p != '\0'; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+char *wordEnd(char *text) {
+    /*
+    Find the end of a blank-separated word, a $(...) inside it counts as part of the word
+    :param: start of the word
+    :retrn: the blank or terminator after it
+    */
+    while (*text != '\0' && *text != ' ' && *text != '\t') {
+        if (text[0] == '$' && text[1] == '(' && substEnd(text) != NULL) {
+            text = substEnd(text);
+            continue;
+        }
+        text++;
+    }
+    return text;
+}
+
+// command substitution runs whole commands, it lives with the code that launches them
+void substitute(struct arena *a, char **out, size_t *outLen, size_t *cap, char *text, size_t len);
+
+char *expandWord(struct arena *a, char *word, size_t len) {
+    /*
+    Expand $$ (shell PID), $? (last status), $! (last background PID), $0, $1-$9, $# and $@/$* (function arguments),
+    $NAME and ${NAME} (environment) and $(command) in one left-to-right pass, writing the result straight into the
+    arena
+    :param: arena for the new word, word, word length
+    :retrn: expanded word
+    */
+    char number[16];
+    size_t cap = len * 2 + 16;
+    size_t outLen = 0;
+    char *out = arenaAlloc(a, cap);
+    size_t i = 0;
+
+    // the PID never changes, format it once
+    if (pidLen == 0) {
+        pidLen = sprintf(pidString, "%d", getpid());
+    }
+
+    while (i < len) {
+        // copy the run of plain characters up to the next $
+        char *dollar = memchr(word + i, '$', len - i);
+        size_t plain = dollar == NULL ? len - i : (size_t)(dollar - (word + i));
+        appendText(a, &out, &outLen, &cap, word + i, plain);
+        i += plain;
+        if (i >= len) {
+            break;
+        }
+
+        // i is at a $, look at what follows
+        char next = i + 1 < len ? word[i + 1] : '\0';
+        if (next == '$') {
+            appendText(a, &out, &outLen, &cap, pidString, pidLen);
+            i += 2;
+        } else if (next == '?') {
+            appendText(a, &out, &outLen, &cap, number, sprintf(number, "%d", statusVar));
+            i += 2;
+        } else if (next == '!') {
+            if (lastBgPID != 0) {
+                appendText(a, &out, &outLen, &cap, number, sprintf(number, "%d", lastBgPID));
+            }
+            i += 2;
+        } else if (next == '(' && substEnd(word + i) != NULL && substEnd(word + i) <= word + len) {
+            char *end = substEnd(word + i);
+            substitute(a, &out, &outLen, &cap, word + i + 2, end - (word + i + 2) - 1);
+            i = end - word;
+        } else if (next == '0') {
+            appendText(a, &out, &outLen, &cap, shellName, strlen(shellName));
+            i += 2;
+        } else if (next >= '1' && next <= '9') {
+            if (next - '0' <= posCount) {
+                char *arg = posArgs[next - '1'];
+                appendText(a, &out, &outLen, &cap, arg, strlen(arg));
+            }
+            i += 2;
+        } else if (next == '#') {
+            appendText(a, &out, &outLen, &cap, number, sprintf(number, "%d", posCount));
+            i += 2;
+        } else if (next == '@' || next == '*') {
+            int arg;
+            for (arg = 0; arg < posCount; arg++) {
+                if (arg > 0) {
+                    appendText(a, &out, &outLen, &cap, " ", 1);
+                }
+                appendText(a, &out, &outLen, &cap, posArgs[arg], strlen(posArgs[arg]));
+            }
+            i += 2;
+        } else if (next == '_' || (next >= 'A' && next <= 'Z') || (next >= 'a' && next <= 'z') || next == '{') {
+            // find the variable name, braced or bare
+            size_t nameStart = next == '{' ? i + 2 : i + 1;
+            size_t nameEnd = nameStart;
+            while (nameEnd < len && (word[nameEnd] == '_' || (word[nameEnd] >= 'A' && word[nameEnd] <= 'Z') ||
+                   (word[nameEnd] >= 'a' && word[nameEnd] <= 'z') || (word[nameEnd] >= '0' && word[nameEnd] <= '9'))) {
+                nameEnd++;
+            }
+            // ${ without a closing brace or a name stays literal
+            if (next == '{' && (nameEnd >= len || word[nameEnd] != '}' || nameEnd == nameStart)) {
+                appendText(a, &out, &outLen, &cap, "$", 1);
+                i++;
+                continue;
+            }
+            // getenv needs a terminated name, borrow the byte after it
+            char saved = word[nameEnd];
+            word[nameEnd] = '\0';
+            char *value = getenv(word + nameStart);
+            word[nameEnd] = saved;
+            if (value != NULL) {
+                appendText(a, &out, &outLen, &cap, value, strlen(value));
+            }
+            i = next == '{' ? nameEnd + 1 : nameEnd;
+        } else {
+            // lone $
+            appendText(a, &out, &outLen, &cap, "$", 1);
+            i++;
+        }
+    }
+    out[outLen] = '\0';
+    return out;
+}
+
+int noComment(void) {
+    /*
+    This will ignore all processing and jump to a new command line when the user either hits enter immediately or types a line beginning with a '#'
+    :retrn: no comment bool
+    */
+    // check for comment or blank line (the reader strips the newline)
+    if (sh_input[0] == '#' || sh_input[0] == '\n' || sh_input[0] == '\0') {
+        return 0;
+    }
+    return 1;
+}
+
+int globChars(char *word) {
+    /*
+    Check whether a word is a pattern - it holds * or ?, or a [ closed by a later ]
+    :param: word
+    :retrn: 1 when it has to be matched against file names
+    */
+    char *p;
+    for (p = word; *p != '\0'; p++) {
+        if (*p == '*' || *p == '?') {
+            return 1;
+        }
+        // ] right after [ (or [!) is a member, not the end
+        if (*p == '[') {
+            char *close = p + 1 + (p[1] == '!' || p[1] == '^');
+            if (*close != '\0' && strchr(close + 1, ']') != NULL) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int globMatch(const char *pattern, size_t patLen, const char *name) {
+    /*
+    Match a name against one path component of a pattern - * any run, ? any character, [abc] [a-z] [!x] a set
+    :param: pattern component, its length, file name
+    :retrn: 1 on a match
+    */
+    const char *end = pattern + patLen;
+    const char *star = NULL;
+    const char *starName = NULL;
+
+    while (*name != '\0') {
+        if (pattern < end && *pattern == '*') {
+            // remember where to resume if what follows the * fails later
+            star = ++pattern;
+            starName = name;
+            continue;
+        }
+        if (pattern < end && *pattern == '[') {
+            const char *p = pattern + 1;
+            int negate = *p == '!' || *p == '^';
+            int found = 0;
+            p += negate;
+            // ] first in the set is a member
+            do {
+                if (p + 2 < end && p[1] == '-' && p[2] != ']') {
+                    found |= (unsigned char)*name >= (unsigned char)p[0] && (unsigned char)*name <= (unsigned char)p[2];
+                    p += 3;
+                } else {
+                    found |= *name == *p;
+                    p++;
+                }
+            } while (p < end && *p != ']');
+            if (p < end && found != negate) {
+                pattern = p + 1;
+                name++;
+                continue;
+            }
+            // no ] in this component, the [ is an ordinary character
+            if (p >= end && *name == '[') {
+                pattern++;
+                name++;
+                continue;
+            }
+        } else if (pattern < end && (*pattern == '?' || *pattern == *name)) {
+            pattern++;
+            name++;
+            continue;
+        }
+        // mismatch, let the last * swallow one more character
+        if (star == NULL) {
+            return 0;
+        }
+        pattern = star;
+        name = ++starName;
+    }
+    while (pattern < end && *pattern == '*') {
+        pattern++;
+    }
+    return pattern == end;
+}
+
+int compareNames(const void *a, const void *b) {
+    /*
+    qsort order for a directory listing
+    :param: two name pointers
+    :retrn: strcmp result
+    */
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+void freeListing(struct dir_listing *dir) {
+    /*
+    Release the names of a directory listing, the entry itself stays
+    :param: listing
+    */
+    free(dir->storage);
+    free(dir->names);
+    free(dir->lengths);
+    dir->storage = NULL;
+    dir->names = NULL;
+    dir->lengths = NULL;
+}
+
+struct dir_listing *listDirectory(char *path) {
+    /*
+    Names in a directory, sorted - served from the cache while the directory's inode and mtime are unchanged,
+    otherwise read with large getdents64 batches. A listing taken within a second of the directory's last change
+    could miss a change in the same timestamp tick, so it is read again next time
+    :param: directory path
+    :retrn: listing, NULL when the path is not a readable directory
+    */
+    static char *batch = NULL;
+    struct dir_listing **link = &dirCache;
+    struct dir_listing *dir;
+    struct timespec now;
+    struct stat st;
+    size_t used = 0;
+    size_t cap = 4096;
+    int count = 0;
+    int cached = 0;
+    int fd;
+
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+    while ((dir = *link) != NULL) {
+        if (dir->dev == st.st_dev && dir->ino == st.st_ino) {
+            // unlink it, it goes back in front
+            *link = dir->next;
+            break;
+        }
+        link = &dir->next;
+        cached++;
+    }
+    // a listing being walked further up the pattern is kept as it is
+    if (dir != NULL && (dir->busy > 0 || (dir->trusted == 1 && dir->mtime.tv_sec == st.st_mtim.tv_sec &&
+        dir->mtime.tv_nsec == st.st_mtim.tv_nsec))) {
+        dir->next = dirCache;
+        dirCache = dir;
+        return dir;
+    }
+
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        if (dir != NULL) {
+            freeListing(dir);
+            free(dir);
+        }
+        return NULL;
+    }
+    if (dir == NULL) {
+        // a full cache drops the directory used longest ago that is not being walked
+        if (cached >= GLOB_CACHE_DIRS) {
+            struct dir_listing **oldest = NULL;
+            for (link = &dirCache; *link != NULL; link = &(*link)->next) {
+                if ((*link)->busy == 0) {
+                    oldest = link;
+                }
+            }
+            if (oldest != NULL) {
+                struct dir_listing *evicted = *oldest;
+                *oldest = evicted->next;
+                freeListing(evicted);
+                free(evicted);
+            }
+        }
+        dir = calloc(1, sizeof(struct dir_listing));
+    } else {
+        freeListing(dir);
+    }
+    if (batch == NULL) {
+        batch = malloc(GLOB_BATCH);
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+    dir->mtime = st.st_mtim;
+    dir->trusted = now.tv_sec - st.st_mtim.tv_sec > 1;
+    dir->storage = malloc(cap);
+
+    // names are packed end to end, . and .. are left out
+    while (1) {
+        long got = syscall(SYS_getdents64, fd, batch, GLOB_BATCH);
+        long pos;
+        if (got <= 0) {
+            break;
+        }
+        for (pos = 0; pos < got; ) {
+            struct sh_dirent *d = (struct sh_dirent *)(batch + pos);
+            size_t len = strlen(d->d_name);
+            pos += d->d_reclen;
+            if (d->d_name[0] == '.' && (len == 1 || (len == 2 && d->d_name[1] == '.'))) {
+                continue;
+            }
+            if (used + len + 1 > cap) {
+                while (used + len + 1 > cap) {
+                    cap *= 2;
+                }
+                dir->storage = realloc(dir->storage, cap);
+            }
+            memcpy(dir->storage + used, d->d_name, len + 1);
+            used += len + 1;
+            count++;
+        }
+    }
+    close(fd);
+
+    dir->count = count;
+    dir->names = malloc((count + 1) * sizeof(char *));
+    dir->lengths = malloc(count + 1);
+    for (count = 0, used = 0; count < dir->count; count++) {
+        dir->names[count] = dir->storage + used;
+        used += strlen(dir->storage + used) + 1;
+    }
+    qsort(dir->names, dir->count, sizeof(char *), compareNames);
+    for (count = 0; count < dir->count; count++) {
+        dir->lengths[count] = strlen(dir->names[count]);
+    }
+    dir->next = dirCache;
+    dirCache = dir;
+    return dir;
+}
+
+int globPath(struct arena *a, char *path, size_t pathLen, char *pattern, int argCount) {
+    /*
+    Extend a path by the components left in the pattern, adding every existing match to argScratch in order
+    :param: arena for the matches, path so far (buffer of PATH_MAX), its length, rest of the pattern, words so far
+    :retrn: words collected now, -1 when there are too many
+    */
+    char *slash = strchr(pattern, '/');
+    size_t compLen = slash != NULL ? (size_t)(slash - pattern) : strlen(pattern);
+    char *rest = slash != NULL ? slash + 1 : NULL;
+    struct dir_listing *dir;
+    char saved = pattern[compLen];
+    size_t prefixLen = strcspn(pattern, "*?[");
+    char *suffix = NULL;
+    size_t suffixLen = 0;
+    int low = 0;
+    int high;
+    int i;
+
+    // the whole pattern is used up, the path is a match if it exists
+    if (pattern[0] == '\0') {
+        struct stat st;
+        if (lstat(path, &st) == -1) {
+            return argCount;
+        }
+        if (argRoom(argCount) == -1) {
+            return -1;
+        }
+        argScratch[argCount] = arenaAlloc(a, pathLen + 1);
+        memcpy(argScratch[argCount], path, pathLen + 1);
+        return argCount + 1;
+    }
+
+    // a plain component is taken as written
+    pattern[compLen] = '\0';
+    if (globChars(pattern) == 0) {
+        pattern[compLen] = saved;
+        if (pathLen + compLen + 2 >= PATH_MAX) {
+            return argCount;
+        }
+        memcpy(path + pathLen, pattern, compLen);
+        pathLen += compLen;
+        if (rest != NULL) {
+            path[pathLen++] = '/';
+        }
+        path[pathLen] = '\0';
+        return globPath(a, path, pathLen, rest != NULL ? rest : pattern + compLen, argCount);
+    }
+    pattern[compLen] = saved;
+
+    dir = listDirectory(pathLen == 0 ? "." : path);
+    if (dir == NULL) {
+        return argCount;
+    }
+
+    // the plain text before the first special character picks a run of the sorted names
+    high = dir->count;
+    while (prefixLen > 0 && low < high) {
+        int mid = (low + high) / 2;
+        if (strncmp(dir->names[mid], pattern, prefixLen) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    // and the plain text after the last * has to end the name
+    for (i = compLen; i > 0 && pattern[i - 1] != '*' && pattern[i - 1] != '?' && pattern[i - 1] != ']'; i--);
+    if (i > 0 && pattern[i - 1] == '*') {
+        suffix = pattern + i;
+        suffixLen = compLen - i;
+    }
+
+    dir->busy++;
+    for (i = low; i < dir->count && argCount != -1; i++) {
+        char *name = dir->names[i];
+        size_t nameLen = dir->lengths[i];
+        if (prefixLen > 0 && strncmp(name, pattern, prefixLen) != 0) {
+            break;
+        }
+        if (suffixLen > 0 && (nameLen < prefixLen + suffixLen || memcmp(name + nameLen - suffixLen, suffix, suffixLen) != 0)) {
+            continue;
+        }
+        // names starting with . only match a pattern that does
+        if (name[0] == '.' && pattern[0] != '.') {
+            continue;
+        }
+        if (globMatch(pattern, compLen, name) == 0) {
+            continue;
+        }
+        if (pathLen + nameLen + 2 >= PATH_MAX) {
+            continue;
+        }
+        // a match in the last component came from the listing, it needs no further check
+        if (rest == NULL) {
+            if (argRoom(argCount) == -1) {
+                argCount = -1;
+                break;
+            }
+            argScratch[argCount] = arenaAlloc(a, pathLen + nameLen + 1);
+            memcpy(argScratch[argCount], path, pathLen);
+            memcpy(argScratch[argCount] + pathLen, name, nameLen + 1);
+            argCount++;
+            continue;
+        }
+        memcpy(path + pathLen, name, nameLen);
+        path[pathLen + nameLen] = '/';
+        path[pathLen + nameLen + 1] = '\0';
+        argCount = globPath(a, path, pathLen + nameLen + 1, rest, argCount);
+    }
+    dir->busy--;
+    path[pathLen] = '\0';
+    return argCount;
+}
+
+int globWord(struct arena *a, char *word, int argCount) {
+    /*
+    Pathname expansion - add the sorted names matching a pattern to argScratch, or the word itself when nothing
+    matches (as sh does)
+    :param: arena for the names, pattern (a word globChars accepted), words so far
+    :retrn: words collected now, -1 after printing that there are too many
+    */
+    char path[PATH_MAX];
+    int found;
+
+    path[0] = '\0';
+    if (word[0] == '/') {
+        path[0] = '/';
+        path[1] = '\0';
+        found = globPath(a, path, 1, word + 1, argCount);
+    } else {
+        found = globPath(a, path, 0, word, argCount);
+    }
+    if (found == argCount) {
+        if (argRoom(argCount) == -1) {
+            return -1;
+        }
+        argScratch[found++] = word;
+    }
+    return found;
+}
+
+unsigned int hashName(char *name) {
+    /*
+    djb2 string hash for the command path cache
+    :param: command name
+    :retrn: bucket index
+    */
+    unsigned int h = 5381;
+    while (*name != '\0') {
+        h = h * 33 + (unsigned char)*name;
+        name++;
+    }
+    return h % HASH_BUCKETS;
+}
+
+void clearPathTable(void) {
+    /*
+    Forget every cached command path (hash -r, or PATH changed)
+    */
+    int i;
+    for (i = 0; i < HASH_BUCKETS; i++) {
+        struct path_entry *e = pathTable[i];
+        while (e != NULL) {
+            struct path_entry *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        pathTable[i] = NULL;
+    }
+}
+
+char *findInPath(char *name) {
+    /*
+    Walk $PATH once for an executable regular file, the way execvp would, but with access() instead of failed execs
+    :param: bare command name
+    :retrn: newly allocated absolute path, NULL if not found
+    */
+    char *path = getenv("PATH");
+    if (path == NULL) {
+        path = "/bin:/usr/bin";
+    }
+    size_t nameLen = strlen(name);
+    char *candidate = malloc(strlen(path) + nameLen + 3);
+    struct stat sb;
+
+    while (1) {
+        // copy one directory, an empty entry means the current directory
+        char *end = strchrnul(path, ':');
+        size_t dirLen = end - path;
+        if (dirLen == 0) {
+            candidate[0] = '.';
+            dirLen = 1;
+        } else {
+            memcpy(candidate, path, dirLen);
+        }
+        candidate[dirLen] = '/';
+        memcpy(candidate + dirLen + 1, name, nameLen + 1);
+
+        if (access(candidate, X_OK) == 0 && stat(candidate, &sb) == 0 && S_ISREG(sb.st_mode)) {
+            return candidate;
+        }
+        if (*end == '\0') {
+            break;
+        }
+        path = end + 1;
+    }
+    free(candidate);
+    return NULL;
+}
+
+char *lookupCommand(char *name) {
+    /*
+    Resolve a command through the path cache, filling it on first use
+    :param: command name
+    :retrn: absolute path (owned by the cache), or NULL if the name holds a '/' or is not on PATH
+    */
+    // paths are used as given, like execvp
+    if (strchr(name, '/') != NULL) {
+        return NULL;
+    }
+
+    // drop the whole cache when PATH no longer matches the one it was built against
+    char *path = getenv("PATH");
+    if (path == NULL) {
+        path = "";
+    }
+    if (hashedPATH == NULL || strcmp(hashedPATH, path) != 0) {
+        clearPathTable();
+        free(hashedPATH);
+        hashedPATH = strdup(path);
+    }
+
+    unsigned int bucket = hashName(name);
+    struct path_entry **link = &pathTable[bucket];
+    while (*link != NULL) {
+        struct path_entry *e = *link;
+        if (strcmp(e->name, name) == 0) {
+            // still there - one access() instead of a PATH walk
+            if (access(e->path, X_OK) == 0) {
+                e->hits++;
+                hashHits++;
+                return e->path;
+            }
+            // cached path disappeared, unlink and search again
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            break;
+        }
+        link = &e->next;
+    }
+
+    hashMisses++;
+    char *found = findInPath(name);
+    if (found == NULL) {
+        return NULL;
+    }
+    struct path_entry *e = malloc(sizeof(struct path_entry));
+    e->name = strdup(name);
+    e->path = found;
+    // the lookup that filled the entry is a miss, counted in the totals only
+    e->hits = 0;
+    e->next = pathTable[bucket];
+    pathTable[bucket] = e;
+    return found;
+}
+
+void printPathTable(void) {
+    /*
+    List the cached command paths with their hit counts, followed by the cache totals
+    */
+    int i;
+    int any = 0;
+    for (i = 0; i < HASH_BUCKETS; i++) {
+        struct path_entry *e;
+        for (e = pathTable[i]; e != NULL; e = e->next) {
+            if (any == 0) {
+                printf("hits\tcommand\n");
+                any = 1;
+            }
+            printf("%4d\t%s\n", e->hits, e->path);
+        }
+    }
+    if (any == 0) {
+        printf("hash: hash table empty\n");
+    }
+    printf("hash: %d hits, %d misses\n", hashHits, hashMisses);
+    fflush(stdout);
+}
+
+long long nowNanos(void) {
+    /*
+    Monotonic clock in nanoseconds, for --trace timestamps
+    :retrn: nanoseconds
+    */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void histAdd(struct histogram *h, long long ns) {
+    /*
+    Count one sample - values below 8ns get their own bucket, above that 8 buckets per power of two
+    :param: histogram, sample in nanoseconds
+    */
+    int bucket;
+
+    if (ns < 0) {
+        ns = 0;
+    }
+    if (ns < 8) {
+        bucket = ns;
+    } else {
+        int msb = 63 - __builtin_clzll(ns);
+        bucket = (msb - 2) * 8 + ((ns >> (msb - 3)) & 7);
+    }
+    h->buckets[bucket]++;
+    h->count++;
+    if (ns > h->max) {
+        h->max = ns;
+    }
+}
+
+long long histPercentile(struct histogram *h, double pct) {
+    /*
+    Upper bound of the bucket holding the given percentile (within 12.5% of the real value)
+    :param: histogram, percentile 0-100
+    :retrn: nanoseconds
+    */
+    long rank = (long)(h->count * pct / 100.0 + 0.5);
+    long seen = 0;
+    int i;
+
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    if (i < 8) {
+        return i;
+    }
+    int msb = i / 8 + 2;
+    long long upper = ((long long)(8 + i % 8 + 1) << (msb - 3)) - 1;
+    return upper < h->max ? upper : h->max;
+}
+
+void formatNanos(char *buf, size_t size, long long ns) {
+    /*
+    Render a duration with a readable unit
+    :param: output buffer, its size, nanoseconds
+    */
+    if (ns < 1000) {
+        snprintf(buf, size, "%lldns", ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, size, "%.2fms", ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+    }
+}
+
+void traceString(FILE *out, char *text) {
+    /*
+    Write text as a JSON string
+    :param: stream, text
+    */
+    fputc('"', out);
+    for (; *text != '\0'; text++) {
+        unsigned char c = *text;
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+char *traceLaunch(struct sh_pipeline *pipeline) {
+    /*
+    Start a job's trace record with its parse and per-stage launch timestamps, and count those phases.
+    The wait half is added by traceFinish once the job is reaped
+    :param: pipeline that was just launched
+    :retrn: malloc'd record without its closing brace
+    */
+    struct sh_command *stage;
+    char *record = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&record, &size);
+
+    if (out == NULL) {
+        return NULL;
+    }
+    fprintf(out, "{\"seq\":%ld,\"cmd\":", ++traceSeq);
+    traceString(out, pipeline->text);
+    fprintf(out, ",\"parse_start\":%lld,\"parse_end\":%lld,\"background\":%d,\"stages\":[",
+            pipeline->parseStart, pipeline->parseEnd, pipeline->background);
+    if (pipeline->parseStart != 0) {
+        histAdd(&phaseHist[TRACE_PARSE], pipeline->parseEnd - pipeline->parseStart);
+    }
+
+    for (stage = pipeline->first; stage != NULL; stage = stage->next) {
+        fprintf(out, "%s{\"argv0\":", stage == pipeline->first ? "" : ",");
+        traceString(out, stage->command);
+        fprintf(out, ",\"lookup_start\":%lld,\"lookup_end\":%lld", stage->lookupStart, stage->lookupEnd);
+        histAdd(&phaseHist[TRACE_LOOKUP], stage->lookupEnd - stage->lookupStart);
+        // a stage rejected by the path lookup was never forked
+        if (stage->forkStart == 0) {
+            fprintf(out, ",\"fork_start\":null,\"fork_end\":null,\"pre_exec\":null}");
+            continue;
+        }
+        fprintf(out, ",\"fork_start\":%lld,\"fork_end\":%lld", stage->forkStart, stage->forkEnd);
+        histAdd(&phaseHist[TRACE_FORK], stage->forkEnd - stage->forkStart);
+        // posix_spawn and children that fail before exec have no pre-exec stamp
+        if (stage->preExec != 0) {
+            fprintf(out, ",\"pre_exec\":%lld}", stage->preExec);
+            histAdd(&phaseHist[TRACE_EXEC], stage->preExec - stage->forkStart);
+        } else {
+            fprintf(out, ",\"pre_exec\":null}");
+        }
+    }
+    fprintf(out, "]");
+    fclose(out);
+    return record;
+}
+
+void traceFinish(struct sh_job *job) {
+    /*
+    Complete a reaped job's trace record with its wait timestamp and status, and write it out
+    :param: job
+    */
+    long long waitEnd = job->end.tv_sec * 1000000000LL + job->end.tv_nsec;
+    long long launched = job->start.tv_sec * 1000000000LL + job->start.tv_nsec;
+
+    long long submitted = job->submitted.tv_sec * 1000000000LL + job->submitted.tv_nsec;
+
+    histAdd(&phaseHist[TRACE_WAIT], waitEnd - launched);
+    if (job->queued == 1) {
+        histAdd(&phaseHist[TRACE_QUEUE], launched - submitted);
+    }
+    fprintf(traceFile, "%s,\"queue_wait\":%lld,\"wait_end\":%lld,\"exit\":%d,\"signal\":%d,\"timed_out\":%d}\n",
+            job->trace, launched - submitted, waitEnd,
+            WIFEXITED(job->status) ? WEXITSTATUS(job->status) : -1,
+            WIFSIGNALED(job->status) ? WTERMSIG(job->status) : 0, job->timedOut);
+    fflush(traceFile);
+    free(job->trace);
+    job->trace = NULL;
+}
+
+void traceBuiltIn(struct sh_pipeline *pipeline, long long runStart, long long runEnd) {
+    /*
+    Write the trace record of a line handled inside the shell
+    :param: pipeline, builtin start and end timestamps
+    */
+    // compiled lines were parsed ahead of time, no parse phase to count
+    if (pipeline->parseStart != 0) {
+        histAdd(&phaseHist[TRACE_PARSE], pipeline->parseEnd - pipeline->parseStart);
+    }
+    histAdd(&phaseHist[TRACE_BUILTIN], runEnd - runStart);
+    fprintf(traceFile, "{\"seq\":%ld,\"cmd\":", ++traceSeq);
+    traceString(traceFile, pipeline->text);
+    fprintf(traceFile, ",\"parse_start\":%lld,\"parse_end\":%lld,\"builtin\":", pipeline->parseStart,
+            pipeline->parseEnd);
+    traceString(traceFile, pipeline->first->command);
+    fprintf(traceFile, ",\"run_start\":%lld,\"run_end\":%lld,\"exit\":%d}\n", runStart, runEnd, statusVar);
+    fflush(traceFile);
+}
+
+int nullFD(void) {
+    /*
+    The shell's /dev/null descriptor, opened close-on-exec on first use (at startup) and only dup2'd after that
+    :retrn: descriptor, -1 if /dev/null can't be opened
+    */
+    if (devNull == -1) {
+        devNull = open("/dev/null", O_RDWR | O_CLOEXEC);
+    }
+    return devNull;
+}
+
+int redirectOperator(char *word, int *fd, int *kind) {
+    /*
+    Recognise a redirection operator at the start of a word: [n]< [n]> [n]>> [n]<& [n]>& &> &>>
+    :param: word, where to store the descriptor it applies to and the kind
+    :retrn: length of the operator, 0 when the word isn't a redirection
+    */
+    char *ptr = word;
+    int n = -1;
+
+    if (word[0] == '&' && word[1] == '>') {
+        *fd = 1;
+        if (word[2] == '>') {
+            *kind = REDIR_BOTH_APPEND;
+            return 3;
+        }
+        *kind = REDIR_BOTH;
+        return 2;
+    }
+    // explicit descriptor number
+    while (*ptr >= '0' && *ptr <= '9' && n < 1024) {
+        n = (n == -1 ? 0 : n * 10) + (*ptr - '0');
+        ptr++;
+    }
+    if (*ptr == '<') {
+        *fd = n == -1 ? 0 : n;
+        *kind = ptr[1] == '&' ? REDIR_DUP : REDIR_IN;
+    } else if (*ptr == '>') {
+        *fd = n == -1 ? 1 : n;
+        *kind = ptr[1] == '>' ? REDIR_APPEND : ptr[1] == '&' ? REDIR_DUP : REDIR_OUT;
+    } else {
+        return 0;
+    }
+    return ptr - word + (*kind == REDIR_IN || *kind == REDIR_OUT ? 1 : 2);
+}
+
+struct sh_redirect *addRedirect(struct sh_pipeline *pipeline, struct sh_command *newCommand, int fd, int kind) {
+    /*
+    Append a redirection to a stage's list, in the arena - its target is filled in once it is read
+    :param: pipeline struct, stage, descriptor, kind
+    :retrn: new redirection
+    */
+    struct sh_redirect *r = arenaAlloc(&pipeline->arena, sizeof(struct sh_redirect));
+    r->fd = fd;
+    r->kind = kind;
+    r->target = NULL;
+    r->next = NULL;
+    if (newCommand->lastRedirect == NULL) {
+        newCommand->redirects = r;
+    } else {
+        newCommand->lastRedirect->next = r;
+    }
+    newCommand->lastRedirect = r;
+    return r;
+}
+
+int setRedirectTarget(struct sh_pipeline *pipeline, struct sh_command *newCommand, struct sh_redirect *r,
+                      char *target) {
+    /*
+    Give a redirection its target - &> becomes >file followed by 2>&1, a copy needs a descriptor number or -
+    :param: pipeline struct, stage, redirection, target word
+    :retrn: 0, or -1 after printing why the target is unusable
+    */
+    r->target = target;
+    if (r->kind == REDIR_DUP) {
+        size_t digits = strspn(target, "0123456789");
+        if ((digits == 0 || target[digits] != '\0') && strcmp(target, "-") != 0) {
+            printf("%s: bad file descriptor\n", target);
+            fflush(stdout);
+            return -1;
+        }
+    } else if (r->kind == REDIR_BOTH || r->kind == REDIR_BOTH_APPEND) {
+        r->kind = r->kind == REDIR_BOTH ? REDIR_OUT : REDIR_APPEND;
+        addRedirect(pipeline, newCommand, 2, REDIR_DUP)->target = "1";
+    }
+    return 0;
+}
+
+struct sh_redirect *findRedirect(struct sh_command *newCommand, int fd) {
+    /*
+    Last redirection of a descriptor, the one that wins
+    :param: command struct, descriptor
+    :retrn: redirection, NULL when fd is left alone
+    */
+    struct sh_redirect *r;
+    struct sh_redirect *found = NULL;
+    for (r = newCommand->redirects; r != NULL; r = r->next) {
+        if (r->fd == fd) {
+            found = r;
+        }
+    }
+    return found;
+}
+
+int openRedirect(struct sh_redirect *r) {
+    /*
+    Open a redirection's file close-on-exec, the caller dup2s it into place
+    :param: file redirection
+    :retrn: descriptor, -1 after printing the error
+    */
+    int fd;
+    if (r->kind == REDIR_IN) {
+        fd = open(r->target, O_RDONLY | O_CLOEXEC);
+    } else if (r->kind == REDIR_APPEND) {
+        fd = open(r->target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    } else {
+        fd = open(r->target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd == -1) {
+        printf("Cannot open %s for %s\n", r->target, r->kind == REDIR_IN ? "input" : "output");
+        fflush(stdout);
+    }
+    return fd;
+}
+
+int splitFields(char *text, int argCount) {
+    /*
+    Split expanded text on blanks and newlines (in place) into words of the stage being collected
+    :param: text, words collected so far
+    :retrn: words collected now, -1 after printing that there are too many
+    */
+    char *save = NULL;
+    char *field = strtok_r(text, " \t\n", &save);
+    while (field != NULL) {
+        if (argRoom(argCount) == -1) {
+            return -1;
+        }
+        argScratch[argCount++] = field;
+        field = strtok_r(NULL, " \t\n", &save);
+    }
+    return argCount;
+}
+
+int endStage(struct sh_pipeline *pipeline, struct sh_command *newCommand, int argCount) {
+    /*
+    Give a finished stage its argv, copied from the scratch words into the arena
+    :param: pipeline struct, stage, number of words collected
+    :retrn: 0 on success, -1 when the stage has no command
+    */
+    if (argCount == 0) {
+        return -1;
+    }
+    argScratch[argCount] = NULL;
+    newCommand->args = arenaAlloc(&pipeline->arena, (argCount + 1) * sizeof(char *));
+    memcpy(newCommand->args, argScratch, (argCount + 1) * sizeof(char *));
+    newCommand->argc = argCount;
+    newCommand->command = newCommand->args[0];
+    return 0;
+}
+
+int parseInput(char *commandLine, struct sh_pipeline *pipeline) {
+    /*
+    Separate user input into sh_command stages of the pipeline, split on '|', in a single pass. Words are cut
+    out of the line in place and only words holding $ are rebuilt (in the pipeline's arena), so parsing makes
+    no heap allocations once the arena has grown to fit
+    :param: user input string (modified), pipeline struct
+    :retrn: 0 when the pipeline is ready (an empty line has no args), -1 when the line is rejected
+    */
+    char *curptr = commandLine;
+    struct sh_redirect *redirect = NULL;
+    char *redirSymbol = NULL;
+    int redirFD;
+    int redirKind;
+    size_t opLen;
+    int redirCount = 0;
+    int argCount = 0;
+
+    if (traceFile != NULL) {
+        pipeline->parseStart = nowNanos();
+    }
+    substituted = 0;
+
+    // keep the line as typed for the job table
+    size_t lineLen = strlen(commandLine);
+    pipeline->text = arenaAlloc(&pipeline->arena, lineLen + 1);
+    memcpy(pipeline->text, commandLine, lineLen + 1);
+
+    // first stage of the pipeline
+    struct sh_command *newCommand = addStage(pipeline);
+
+    while (1) {
+        // skip blanks between words
+        while (*curptr == ' ' || *curptr == '\t') {
+            curptr++;
+        }
+        if (*curptr == '\0') {
+            break;
+        }
+
+        // find the end of the word, noting whether it needs expansion
+        char *word = curptr;
+        int hasDollar = 0;
+        int hasSubst = 0;
+        int hasGlob = 0;
+        while (*curptr != '\0' && *curptr != ' ' && *curptr != '\t') {
+            if (*curptr == '*' || *curptr == '?' || *curptr == '[') {
+                hasGlob = 1;
+            } else if (*curptr == '$') {
+                hasDollar = 1;
+                // $(...) is part of the word, blanks and all
+                char *end = curptr[1] == '(' ? substEnd(curptr) : NULL;
+                if (end != NULL) {
+                    hasSubst = 1;
+                    curptr = end;
+                    continue;
+                }
+            }
+            curptr++;
+        }
+        size_t len = curptr - word;
+        // terminate the word in place
+        if (*curptr != '\0') {
+            *curptr++ = '\0';
+        }
+
+        // redirection, the target is attached or the next word
+        if (redirect == NULL && (word[0] == '<' || word[0] == '>' || word[0] == '&' ||
+            (word[0] >= '0' && word[0] <= '9')) && (opLen = redirectOperator(word, &redirFD, &redirKind)) > 0) {
+            if (++redirCount > MAX_REDIRECTS) {
+                printf("Too many redirections (limit %d)\n", MAX_REDIRECTS);
+                fflush(stdout);
+                return -1;
+            }
+            redirect = addRedirect(pipeline, newCommand, redirFD, redirKind);
+            redirSymbol = word;
+            if (opLen == len) {
+                continue;
+            }
+            word += opLen;
+            len -= opLen;
+        }
+
+        // special symbols stand alone
+        if (len == 1 && redirect == NULL) {
+            // pipe indicated, next word starts a new stage
+            if (word[0] == '|') {
+                if (endStage(pipeline, newCommand, argCount) == -1) {
+                    printf("Missing command before |\n");
+                    fflush(stdout);
+                    return -1;
+                }
+                newCommand = addStage(pipeline);
+                argCount = 0;
+                redirCount = 0;
+                continue;
+            // send to background indicated, only as the last word
+            } else if (word[0] == '&' && curptr[strspn(curptr, " \t")] == '\0') {
+                // make the whole pipeline a background job, compiled commands check the mode when they run
+                if (allow_bg == 0 || compiling == 1) {
+                    pipeline->background = 1;
+                    newCommand->background = 1;
+                }
+                break;
+            }
+        }
+
+        // time as the first word reports on the rest of the line
+        if (len == 4 && pipeline->count == 1 && argCount == 0 && redirect == NULL && pipeline->timed == 0 &&
+            memcmp(word, "time", 4) == 0 && curptr[strspn(curptr, " \t")] != '\0') {
+            pipeline->timed = 1;
+            continue;
+        }
+
+        // compiled commands expand each time they run
+        if (hasDollar == 1 && compiling == 1) {
+            pipeline->deferred = 1;
+        // expand $$, $?, $! and variables
+        } else if (hasDollar == 1) {
+            word = expandWord(&pipeline->arena, word, len);
+            // a word that expanded to nothing disappears, like an unset variable in sh
+            if (word[0] == '\0' && redirect == NULL) {
+                continue;
+            }
+            // command output is split into words
+            if (hasSubst == 1 && redirect == NULL) {
+                if ((argCount = splitFields(word, argCount)) == -1) {
+                    return -1;
+                }
+                continue;
+            }
+        }
+
+        // word names the file (or descriptor) for the preceding redirection
+        if (redirect != NULL) {
+            if (setRedirectTarget(pipeline, newCommand, redirect, word) == -1) {
+                return -1;
+            }
+            redirect = NULL;
+            continue;
+        }
+
+        // a pattern becomes the names it matches, compiled commands match each time they run
+        if (hasGlob == 1 && globChars(word) == 1) {
+            if (compiling == 1) {
+                pipeline->deferred = 1;
+            } else {
+                if ((argCount = globWord(&pipeline->arena, word, argCount)) == -1) {
+                    return -1;
+                }
+                continue;
+            }
+        }
+
+        // no special symbols encountered, store command arg
+        if (argRoom(argCount) == -1) {
+            return -1;
+        }
+        argScratch[argCount++] = word;
+    }
+
+    if (redirect != NULL) {
+        printf("Missing file after %s\n", redirSymbol);
+        fflush(stdout);
+        return -1;
+    }
+    // a blank line stays a single empty stage
+    if (endStage(pipeline, newCommand, argCount) == -1 && pipeline->count > 1) {
+        printf("Missing command after |\n");
+        fflush(stdout);
+        return -1;
+    }
+    if (traceFile != NULL) {
+        pipeline->parseEnd = nowNanos();
+    }
+    return 0;
+}
+
+void printCommand(struct sh_command *command) {
+    /*
+    Non-vital function for debugging purposes - prints command struct vars
+    :param: command struct
+    */
+    printf("# DEBUG INFO #\n--- Command: %s\n", command->command);
+    fflush(stdout);
+    int i = 0;
+    while (command->args[i] != NULL) {
+        printf("--- arg: %s\n", command->args[i]);
+        fflush(stdout);
+        i++;
+    }
+    struct sh_redirect *r;
+    for (r = command->redirects; r != NULL; r = r->next) {
+        printf("--- redirect: fd %d kind %d target %s\n", r->fd, r->kind, r->target);
+        fflush(stdout);
+    }
+    printf("--- background: %i\n", command->background);
+    fflush(stdout);
+    printf("##############");
+    fflush(stdout);
+}
+
+void parSigStp(int signum) {
+    /*
+    Signal catching function - activated on receipt of SIGTSTP command, prevents running background
+    :param: signal passed (unused)
+    */
+    // toggle allow-background bool, print message
+    if (allow_bg == 0) {
+        char *message = "\nEntering foreground-only mode (& is now ignored)\n";
+        write(STDOUT_FILENO, message, 50);
+        allow_bg = 1;
+    // toggle allow-background bool and print message
+    } else {
+        char *message = "\nExiting foreground-only mode\n";
+        write(STDOUT_FILENO, message, 30);
+        allow_bg = 0;
+    }
+}
+
+void setupSignals(void) {
+    /*
+    Install the parent's signal dispositions - ignore SIGINT, toggle foreground-only mode on SIGTSTP
+    */
+    // signal handling for parent
+    struct sigaction parIgnore_SIGINT = {0};
+    // ignore other incoming signals
+    sigfillset(&parIgnore_SIGINT.sa_mask);
+    // send to terminating function
+    parIgnore_SIGINT.sa_handler = SIG_IGN;
+    // don't flag anything
+    parIgnore_SIGINT.sa_flags = 0;
+    // set handler on SIGINT
+    sigaction(SIGINT, &parIgnore_SIGINT, NULL);
+
+    // SIGSTP handling for foreground children
+    struct sigaction catch_SIGTSTP = {0};
+    // ignore other incoming signals
+    sigfillset(&catch_SIGTSTP.sa_mask);
+    // send to terminating function
+    catch_SIGTSTP.sa_handler = parSigStp;
+    // don't flag anything
+    catch_SIGTSTP.sa_flags = 0;
+    // set handler on catch_SIGTSTP
+    sigaction(SIGTSTP, &catch_SIGTSTP, NULL);
+
+    // SIGTTOU handling so the shell can hand the terminal to jobs and take it back
+    if (jobControl == 1) {
+        struct sigaction ignore_SIGTTOU = {0};
+        // ignore other incoming signals
+        sigfillset(&ignore_SIGTTOU.sa_mask);
+        // ignore the signal
+        ignore_SIGTTOU.sa_handler = SIG_IGN;
+        // don't flag anything
+        ignore_SIGTTOU.sa_flags = 0;
+        // set handler on SIGTTOU
+        sigaction(SIGTTOU, &ignore_SIGTTOU, NULL);
+    }
+
+    // SIGCHLD stays blocked and is read from a signalfd by the event loop
+    sigset_t childMask;
+    sigemptyset(&childMask);
+    sigaddset(&childMask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childMask, &shellMask);
+    childFD = signalfd(-1, &childMask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+int setSpawnMode(char *mode) {
+    /*
+    Select the launch engine used for external commands
+    :param: engine name, "fork" or "posix"
+    :retrn: 0 on success, -1 for an unknown engine
+    */
+    if (strcmp(mode, "fork") == 0) {
+        spawnMode = SPAWN_FORK;
+    } else if (strcmp(mode, "posix") == 0) {
+        spawnMode = SPAWN_POSIX;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int parseCpuList(char *text, cpu_set_t *set) {
+    /*
+    Read a CPU list like 0-3,6 into a set
+    :param: list text, set to fill
+    :retrn: 0, -1 when the list is malformed or names a CPU out of range
+    */
+    char *p = text;
+    CPU_ZERO(set);
+    while (1) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) {
+            return -1;
+        }
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return -1;
+            }
+            p = end;
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (; first <= last; first++) {
+            CPU_SET(first, set);
+        }
+        if (*p == '\0') {
+            return 0;
+        }
+        if (*p++ != ',') {
+            return -1;
+        }
+    }
+}
+
+void formatCpuList(cpu_set_t *set, char *buf, size_t size) {
+    /*
+    Write a CPU set back as a list with ranges, the reverse of parseCpuList
+    :param: set, buffer, buffer size
+    */
+    size_t used = 0;
+    int cpu = 0;
+    buf[0] = '\0';
+    while (cpu < CPU_SETSIZE) {
+        int last;
+        if (!CPU_ISSET(cpu, set)) {
+            cpu++;
+            continue;
+        }
+        for (last = cpu; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set); last++);
+        if (used + 24 < size) {
+            used += sprintf(buf + used, last > cpu ? "%s%d-%d" : "%s%d", used > 0 ? "," : "", cpu, last);
+        }
+        cpu = last + 1;
+    }
+}
+
+int placeOption(struct sh_placement *place, char *keyword, char *value) {
+    /*
+    Add one placement setting - cpus LIST, nice N (0-19), ioprio idle|be[:0-7]|rt[:0-7], limit RESOURCE=VALUE
+    :param: placement to add to, keyword, its value
+    :retrn: 1 when taken, 0 when the keyword is not a placement (or nice is not followed by a number), -1 after
+            printing why the value is unusable
+    */
+    char *end;
+    long n;
+    int i;
+
+    if (strcmp(keyword, "cpus") == 0) {
+        if (parseCpuList(value, &place->cpus) == -1) {
+            printf("cpus: bad CPU list %s\n", value);
+            fflush(stdout);
+            return -1;
+        }
+        place->hasCpus = 1;
+        return 1;
+    }
+    if (strcmp(keyword, "nice") == 0) {
+        n = strtol(value, &end, 10);
+        // only an unsigned number is ours - -N is nice(1)'s increment, it and everything else go to the utility
+        if (value[0] < '0' || value[0] > '9' || *end != '\0') {
+            return 0;
+        }
+        if (n > 19) {
+            printf("nice: %s out of range (0 to 19)\n", value);
+            fflush(stdout);
+            return -1;
+        }
+        place->hasNice = 1;
+        place->nice = n;
+        return 1;
+    }
+    if (strcmp(keyword, "ioprio") == 0) {
+        int class = strncmp(value, "rt", 2) == 0 ? IOPRIO_CLASS_RT : strncmp(value, "be", 2) == 0 ? IOPRIO_CLASS_BE : 0;
+        // best effort and realtime take a level 0 (highest) to 7, 4 by default
+        n = 4;
+        if (class != 0 && value[2] == ':') {
+            n = strtol(value + 3, &end, 10);
+            if (end == value + 3 || *end != '\0') {
+                n = -1;
+            }
+        } else if (class != 0 && value[2] != '\0') {
+            class = 0;
+        } else if (strcmp(value, "idle") == 0) {
+            class = IOPRIO_CLASS_IDLE;
+            n = 0;
+        }
+        if (class == 0 || n < 0 || n > 7) {
+            printf("ioprio: bad class %s (idle, be[:0-7] or rt[:0-7])\n", value);
+            fflush(stdout);
+            return -1;
+        }
+        place->ioprio = class << IOPRIO_CLASS_SHIFT | n;
+        return 1;
+    }
+    if (strcmp(keyword, "limit") == 0) {
+        char *equals = strchr(value, '=');
+        rlim_t amount;
+        for (i = 0; limitNames[i].name != NULL; i++) {
+            if (equals != NULL && strncmp(value, limitNames[i].name, equals - value) == 0 &&
+                limitNames[i].name[equals - value] == '\0') {
+                break;
+            }
+        }
+        if (limitNames[i].name == NULL) {
+            printf("limit: bad resource in %s (as, core, cpu, data, fsize, memlock, nofile, nproc, rss, stack)\n",
+                   value);
+            fflush(stdout);
+            return -1;
+        }
+        if (strcmp(equals + 1, "unlimited") == 0) {
+            amount = RLIM_INFINITY;
+        } else {
+            unsigned long long v = strtoull(equals + 1, &end, 10);
+            // K, M and G count in units of 1024
+            if (*end == 'K' || *end == 'k') {
+                v <<= 10;
+                end++;
+            } else if (*end == 'M' || *end == 'm') {
+                v <<= 20;
+                end++;
+            } else if (*end == 'G' || *end == 'g') {
+                v <<= 30;
+                end++;
+            }
+            if (end == equals + 1 || *end != '\0' || equals[1] == '-') {
+                printf("limit: bad value in %s\n", value);
+                fflush(stdout);
+                return -1;
+            }
+            amount = v;
+        }
+        // a resource given again replaces its earlier value
+        for (n = 0; n < place->limitCount && place->limitResource[n] != limitNames[i].resource; n++);
+        if (n == MAX_LIMITS) {
+            printf("limit: too many limits (%d)\n", MAX_LIMITS);
+            fflush(stdout);
+            return -1;
+        }
+        place->limitResource[n] = limitNames[i].resource;
+        place->limitValue[n] = amount;
+        if (n == place->limitCount) {
+            place->limitCount++;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+void mergePlacement(struct sh_placement *into, struct sh_placement *from) {
+    /*
+    Lay one placement over another - settings in from win, limits are combined
+    :param: placement to change, placement to take settings from
+    */
+    int i;
+    int j;
+    if (from->hasCpus == 1) {
+        into->hasCpus = 1;
+        into->cpus = from->cpus;
+    }
+    if (from->hasNice == 1) {
+        into->hasNice = 1;
+        into->nice = from->nice;
+    }
+    if (from->ioprio != 0) {
+        into->ioprio = from->ioprio;
+    }
+    for (i = 0; i < from->limitCount; i++) {
+        for (j = 0; j < into->limitCount && into->limitResource[j] != from->limitResource[i]; j++);
+        if (j < MAX_LIMITS) {
+            into->limitResource[j] = from->limitResource[i];
+            into->limitValue[j] = from->limitValue[i];
+            if (j == into->limitCount) {
+                into->limitCount++;
+            }
+        }
+    }
+}
+
+double parseDuration(char *text) {
+    /*
+    Read a duration like 30, 1.5s, 2m, 1h or 1d
+    :param: text
+    :retrn: seconds, -1 when it isn't a duration
+    */
+    char *end;
+    double seconds = strtod(text, &end);
+
+    if (end == text || !(seconds >= 0) || seconds > 1e9) {
+        return -1;
+    }
+    if (*end == 'm') {
+        seconds *= 60;
+        end++;
+    } else if (*end == 'h') {
+        seconds *= 3600;
+        end++;
+    } else if (*end == 'd') {
+        seconds *= 86400;
+        end++;
+    } else if (*end == 's') {
+        end++;
+    }
+    return *end == '\0' ? seconds : -1;
+}
+
+int timeoutPrefix(struct sh_pipeline *pipeline, char **words, int count) {
+    /*
+    Read a timeout [-k GRACE] DURATION prefix into the pipeline - 0 turns off the default deadline. Other options
+    and anything that isn't a duration are the timeout utility's, it runs as a plain command then
+    :param: pipeline, words from "timeout" on, how many there are
+    :retrn: words used, 0 when the words are left to the utility
+    */
+    int used = 1;
+    double grace = 0;
+    double limit;
+
+    if (count >= 4 && strcmp(words[1], "-k") == 0) {
+        grace = parseDuration(words[2]);
+        if (grace <= 0) {
+            return 0;
+        }
+        used = 3;
+    }
+    limit = parseDuration(words[used]);
+    if (limit == -1) {
+        return 0;
+    }
+    pipeline->timeout = limit > 0 ? limit : -1;
+    pipeline->grace = grace;
+    return used + 1;
+}
+
+int stripPrefixes(struct sh_pipeline *pipeline) {
+    /*
+    Take timeout and placement prefixes (cpus, nice, ioprio, limit, each with a value) off the front of the first
+    stage. A timeout goes to the pipeline, placement is attached to every stage
+    :param: expanded pipeline
+    :retrn: 0, -1 after printing why the prefixes are unusable
+    */
+    struct sh_command *first = pipeline->first;
+    struct sh_command *stage;
+    struct sh_placement parsed = {0};
+    struct sh_placement *place = NULL;
+    int placed = 0;
+    int skip = 0;
+    char *last = NULL;
+
+    while (first->argc - skip >= 2) {
+        char *word = first->args[skip];
+        int result;
+        if (strcmp(word, "timeout") == 0) {
+            result = timeoutPrefix(pipeline, first->args + skip, first->argc - skip);
+            if (result == 0) {
+                break;
+            }
+            last = word;
+            skip += result;
+            continue;
+        }
+        if (strchr("cnil", word[0]) == NULL) {
+            break;
+        }
+        result = placeOption(&parsed, word, first->args[skip + 1]);
+        if (result == -1) {
+            return -1;
+        }
+        if (result == 0) {
+            break;
+        }
+        placed = 1;
+        last = word;
+        skip += 2;
+    }
+    if (skip == 0) {
+        return 0;
+    }
+    if (skip >= first->argc) {
+        printf("%s: missing command\n", last);
+        fflush(stdout);
+        return -1;
+    }
+    first->args += skip;
+    first->argc -= skip;
+    first->command = first->args[0];
+    if (placed == 1) {
+        place = arenaAlloc(&pipeline->arena, sizeof(struct sh_placement));
+        *place = parsed;
+    }
+    // prefixed commands need processes of their own, even utility builtins
+    for (stage = first; stage != NULL; stage = stage->next) {
+        stage->place = place;
+        stage->external = 1;
+    }
+    return 0;
+}
+
+int applyPlacement(struct sh_placement *place) {
+    /*
+    Runs in the child before exec - pin to CPUs, set niceness, I/O priority and resource limits
+    :param: placement
+    :retrn: 0, -1 after printing which setting failed
+    */
+    int i;
+    if (place->hasCpus == 1 && sched_setaffinity(0, sizeof(cpu_set_t), &place->cpus) == -1) {
+        printf("cpus: %s\n", strerror(errno));
+        fflush(stdout);
+        return -1;
+    }
+    if (place->hasNice == 1 && setpriority(PRIO_PROCESS, 0, place->nice) == -1) {
+        printf("nice: %s\n", strerror(errno));
+        fflush(stdout);
+        return -1;
+    }
+    if (place->ioprio != 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, place->ioprio) == -1) {
+        printf("ioprio: %s\n", strerror(errno));
+        fflush(stdout);
+        return -1;
+    }
+    for (i = 0; i < place->limitCount; i++) {
+        struct rlimit limit = {place->limitValue[i], place->limitValue[i]};
+        if (setrlimit(place->limitResource[i], &limit) == -1) {
+            printf("limit: %s\n", strerror(errno));
+            fflush(stdout);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct sh_placement *jobPlacement(struct sh_pipeline *pipeline, struct sh_placement *effective) {
+    /*
+    Placement for a job about to launch - its prefixes, over the bgplace defaults for background jobs, with the
+    next CPU in turn when & jobs are spread
+    :param: pipeline, storage for a combined placement
+    :retrn: placement to apply (NULL for none)
+    */
+    struct sh_placement *place = pipeline->first->place;
+    cpu_set_t allowed;
+    int cpu = nextCPU;
+    int i;
+
+    if (pipeline->background == 0 || (bgPlaced == 0 && spreadJobs == 0)) {
+        return place;
+    }
+    *effective = bgPlace;
+    if (place != NULL) {
+        mergePlacement(effective, place);
+    }
+    // round-robin over the CPUs the job may use, unless its prefix chose some
+    if (spreadJobs == 1 && (place == NULL || place->hasCpus == 0)) {
+        if (effective->hasCpus == 1) {
+            allowed = effective->cpus;
+        } else if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == -1) {
+            return effective;
+        }
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            cpu = (cpu + 1) % CPU_SETSIZE;
+            if (CPU_ISSET(cpu, &allowed)) {
+                nextCPU = cpu;
+                CPU_ZERO(&effective->cpus);
+                CPU_SET(cpu, &effective->cpus);
+                effective->hasCpus = 1;
+                break;
+            }
+        }
+    }
+    return effective;
+}
+
+void childExec(struct sh_command *newCommand) {
+    /*
+    Runs in a freshly forked child - set up signals and redirection, then replace the image with the command
+    :param: command struct
+    */
+    // guidance from Processes and I/O, and Signal Handling Explorations
+
+    // join the job's process group, the first stage starts it
+    setpgid(0, newCommand->pgid);
+    // the first stage of a foreground job takes the terminal while the shell still ignores SIGTTOU
+    if (jobControl == 1 && newCommand->background == 0 && newCommand->pgid == 0) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+
+    // unblock SIGCHLD again for the command
+    sigprocmask(SIG_SETMASK, &shellMask, NULL);
+
+    // SIGTTOU back to default for the command
+    struct sigaction dfl_SIGTTOU = {0};
+    // ignore other incoming signals
+    sigfillset(&dfl_SIGTTOU.sa_mask);
+    // send to default handling
+    dfl_SIGTTOU.sa_handler = SIG_DFL;
+    // don't flag anything
+    dfl_SIGTTOU.sa_flags = 0;
+    // set handler on SIGTTOU
+    sigaction(SIGTTOU, &dfl_SIGTTOU, NULL);
+
+    // SIGTSTP handling for foreground children
+    struct sigaction catch_SIGTSTP = {0};
+    // ignore other incoming signals
+    sigfillset(&catch_SIGTSTP.sa_mask);
+    // send to terminating function
+    catch_SIGTSTP.sa_handler = SIG_IGN;
+    // don't flag anything
+    catch_SIGTSTP.sa_flags = 0;
+    // set handler on catch_SIGTSTP
+    sigaction(SIGTSTP, &catch_SIGTSTP, NULL);
+
+    // connect pipes first so a stage's own file redirection overrides them
+    if (newCommand->pipeIn != -1 && dup2(newCommand->pipeIn, 0) == -1) {
+        printf("Cannot redirect stdin to pipe\n");
+        fflush(stdout);
+        exit(1);
+    }
+    if (newCommand->pipeOut != -1 && dup2(newCommand->pipeOut, 1) == -1) {
+        printf("Cannot redirect stdout to pipe\n");
+        fflush(stdout);
+        exit(1);
+    }
+
+    // check background process bool
+    if (newCommand->background == 1) {
+        // SIGINT handling for background children
+        struct sigaction bgIgnore_SIGINT = {0};
+        // ignore other incoming signals
+        sigfillset(&bgIgnore_SIGINT.sa_mask);
+        // send to terminating function
+        bgIgnore_SIGINT.sa_handler = SIG_IGN;
+        // don't flag anything
+        bgIgnore_SIGINT.sa_flags = 0;
+        // set handler on SIGINT
+        sigaction(SIGINT, &bgIgnore_SIGINT, NULL);
+    }
+
+    // background output is discarded unless a redirection below sends it somewhere
+    if (newCommand->background == 1 && newCommand->pipeOut == -1) {
+        // the shell's /dev/null, opened once at startup
+        if (dup2(nullFD(), 1) == -1) {
+            printf("Cannot redirect stdout to /dev/null\n");
+            fflush(stdout);
+            exit(1);
+        }
+    }
+
+    // captured background output takes stderr as well
+    if (newCommand->errFD != -1 && dup2(newCommand->errFD, 2) == -1) {
+        printf("Cannot redirect stderr to pipe\n");
+        fflush(stdout);
+        exit(1);
+    }
+
+    // redirections in the order written, so > file 2>&1 and 2>&1 > file differ as in sh
+    struct sh_redirect *r;
+    for (r = newCommand->redirects; r != NULL; r = r->next) {
+        if (r->kind == REDIR_DUP) {
+            if (strcmp(r->target, "-") == 0) {
+                close(r->fd);
+            } else if (dup2(atoi(r->target), r->fd) == -1) {
+                printf("%s: bad file descriptor\n", r->target);
+                fflush(stdout);
+                exit(1);
+            }
+            continue;
+        }
+        int redirFD = openRedirect(r);
+        // failed open
+        if (redirFD == -1) {
+            exit(1);
+        }
+        if (redirFD == r->fd) {
+            // landed on the descriptor itself, keep it across exec
+            fcntl(redirFD, F_SETFD, 0);
+        } else {
+            // failed dup
+            if (dup2(redirFD, r->fd) == -1) {
+                printf("Cannot redirect %d to %s\n", r->fd, r->target);
+                fflush(stdout);
+                exit(1);
+            }
+            close(redirFD);
+        }
+    }
+
+    // foreground process handling
+    if (newCommand->background == 0) {
+        // SIGINT handling for foreground children
+        struct sigaction catch_SIGINT = {0};
+        // ignore other incoming signals
+        sigfillset(&catch_SIGINT.sa_mask);
+        // send to terminating function
+        catch_SIGINT.sa_handler = SIG_DFL;
+        // don't flag anything
+        catch_SIGINT.sa_flags = 0;
+        // set handler on SIGINT
+        sigaction(SIGINT, &catch_SIGINT, NULL);
+    }
+    // CPUs, niceness, I/O priority and limits last, so the shell's own setup above is not limited by them
+    if (newCommand->place != NULL && applyPlacement(newCommand->place) == -1) {
+        exit(1);
+    }
+    // --trace: tell the parent we're about to exec, the pipe closes itself on success
+    if (newCommand->traceFD != -1) {
+        long long preExec = nowNanos();
+        write(newCommand->traceFD, &preExec, sizeof(preExec));
+    }
+    // resolved through the path cache, execvp still handles names with a '/' and scripts without a #! line
+    if (newCommand->execPath != NULL) {
+        execve(newCommand->execPath, newCommand->args, environ);
+    }
+    execvp(newCommand->command, newCommand->args);
+    // failed exec command
+    printf("%s: no such file or directory\n", newCommand->command);
+    fflush(stdout);
+    exit(1);
+}
+
+pid_t forkCommand(struct sh_command *newCommand) {
+    /*
+    Launch engine built on fork - the child does its own signal, redirection, and exec setup
+    :param: command struct
+    :retrn: child PID
+    */
+    // below developed with guidance from http://faculty.cs.niu.edu/~hutchins/csci480/forkexm1.htm and Creating and Terminating Processes Exploration and https://stackoverflow.com/questions/7155810/example-of-waitpid-wnohang-and-sigchld and https://linux.die.net/man/2/waitpid
+
+    // --trace: the child reports its pre-exec time back through a close-on-exec pipe
+    int traceFDs[2] = {-1, -1};
+    if (traceFile != NULL && pipe2(traceFDs, O_CLOEXEC) == 0) {
+        newCommand->traceFD = traceFDs[1];
+    }
+
+    // create child process and begin fork
+    pid_t childPID = fork();
+
+    // evaluate fork
+    switch (childPID) {
+        // failed fork
+        case -1:
+            perror("The fork was unsuccessful.\n");
+            exit(1);
+            break;
+        // successful fork, child never returns
+        case 0:
+            childExec(newCommand);
+            break;
+    }
+
+    if (traceFDs[0] != -1) {
+        long long preExec;
+        ssize_t got;
+        // stamped before waiting on the child so fork time is the parent's alone
+        newCommand->forkEnd = nowNanos();
+        close(traceFDs[1]);
+        newCommand->traceFD = -1;
+        // nothing arrives when the child fails before reaching exec
+        do {
+            got = read(traceFDs[0], &preExec, sizeof(preExec));
+        } while (got == -1 && errno == EINTR);
+        if (got == sizeof(preExec)) {
+            newCommand->preExec = preExec;
+        }
+        close(traceFDs[0]);
+    }
+    return childPID;
+}
+
+pid_t spawnCommand(struct sh_command *newCommand) {
+    /*
+    Launch engine built on posix_spawn - redirection becomes file actions and the child's signal setup becomes
+    spawn attributes, so the shell's page tables are never copied
+    :param: command struct
+    :retrn: child PID, or -1 if the command could not be started (message already printed)
+    */
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t blockMask, oldMask, defaultMask;
+    struct sigaction ignoreTSTP = {0}, savedTSTP;
+    struct sh_redirect *r;
+    int opened[MAX_REDIRECTS];
+    int nOpened = 0;
+    int i;
+    pid_t childPID = -1;
+
+    // open redirection targets in the parent so failures report the same messages as the fork path
+    for (r = newCommand->redirects; r != NULL; r = r->next) {
+        if (r->kind == REDIR_DUP) {
+            continue;
+        }
+        opened[nOpened] = openRedirect(r);
+        if (opened[nOpened] == -1) {
+            for (i = 0; i < nOpened; i++) {
+                close(opened[i]);
+            }
+            return -1;
+        }
+        nOpened++;
+    }
+
+    // dup2 in the child clears close-on-exec on the target descriptor only
+    posix_spawn_file_actions_init(&actions);
+#if __GLIBC_PREREQ(2, 35)
+    // the first stage of a foreground job takes the terminal from inside the child before stdin is replaced,
+    // signals are still blocked there so SIGTTOU cannot stop it
+    if (jobControl == 1 && newCommand->background == 0 && newCommand->pgid == 0) {
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    }
+#endif
+    // pipes first so a stage's own file redirection overrides them
+    if (newCommand->pipeIn != -1) {
+        posix_spawn_file_actions_adddup2(&actions, newCommand->pipeIn, 0);
+    }
+    if (newCommand->pipeOut != -1) {
+        posix_spawn_file_actions_adddup2(&actions, newCommand->pipeOut, 1);
+    } else if (newCommand->background == 1) {
+        // background output is discarded unless redirected below, into the shell's pre-opened /dev/null
+        posix_spawn_file_actions_adddup2(&actions, nullFD(), 1);
+    }
+    if (newCommand->errFD != -1) {
+        posix_spawn_file_actions_adddup2(&actions, newCommand->errFD, 2);
+    }
+    // then redirections in the order written
+    i = 0;
+    for (r = newCommand->redirects; r != NULL; r = r->next) {
+        if (r->kind != REDIR_DUP) {
+            posix_spawn_file_actions_adddup2(&actions, opened[i++], r->fd);
+        } else if (strcmp(r->target, "-") == 0) {
+            posix_spawn_file_actions_addclose(&actions, r->fd);
+        } else {
+            posix_spawn_file_actions_adddup2(&actions, atoi(r->target), r->fd);
+        }
+    }
+
+    // block SIGTSTP while it is briefly ignored so a toggle arriving now is held, not lost
+    sigemptyset(&blockMask);
+    sigaddset(&blockMask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &blockMask, &oldMask);
+    // caught signals reset to default across exec, ignored ones stay ignored - children must ignore SIGTSTP
+    ignoreTSTP.sa_handler = SIG_IGN;
+    sigaction(SIGTSTP, &ignoreTSTP, &savedTSTP);
+
+    // child starts with the shell's original mask, foreground children get default SIGINT back
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &shellMask);
+    sigemptyset(&defaultMask);
+    sigaddset(&defaultMask, SIGTTOU);
+    if (newCommand->background == 0) {
+        sigaddset(&defaultMask, SIGINT);
+    }
+    posix_spawnattr_setsigdefault(&attr, &defaultMask);
+    // join the job's process group, the first stage starts it
+    posix_spawnattr_setpgroup(&attr, newCommand->pgid);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+    int err;
+    if (newCommand->execPath != NULL) {
+        err = posix_spawn(&childPID, newCommand->execPath, &actions, &attr, newCommand->args, environ);
+    } else {
+        err = posix_spawnp(&childPID, newCommand->command, &actions, &attr, newCommand->args, environ);
+    }
+
+    // restore the parent's SIGTSTP handler, then let any held toggle through
+    sigaction(SIGTSTP, &savedTSTP, NULL);
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+#if !__GLIBC_PREREQ(2, 35)
+    if (err == 0 && jobControl == 1 && newCommand->background == 0 && newCommand->pgid == 0) {
+        tcsetpgrp(STDIN_FILENO, childPID);
+    }
+#endif
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    for (i = 0; i < nOpened; i++) {
+        close(opened[i]);
+    }
+
+    // failed exec command
+    if (err != 0) {
+        printf("%s: no such file or directory\n", newCommand->command);
+        fflush(stdout);
+        return -1;
+    }
+    return childPID;
+}
+
+int argsTooLong(struct sh_command *newCommand) {
+    /*
+    Check a command against execve's limits - argv and environment together within ARG_MAX, each string within
+    MAX_ARG_STRLEN - so it fails cleanly here rather than with E2BIG in the child
+    :param: command struct
+    :retrn: 1 after printing which limit it breaks, 0 when it fits
+    */
+    size_t limit = argMaxBytes();
+    size_t total = 0;
+    size_t len;
+    char **word;
+    int i;
+
+    for (i = 0; i < newCommand->argc; i++) {
+        len = strlen(newCommand->args[i]) + 1;
+        if (len > ARG_STRLEN_MAX) {
+            printf("%s: argument %d too long (%zu bytes, limit %d)\n", newCommand->command, i, len, ARG_STRLEN_MAX);
+            fflush(stdout);
+            return 1;
+        }
+        total += len + sizeof(char *);
+    }
+    // the environment is small next to ARG_MAX, only long argument lists need it counted
+    if (total < limit / 2) {
+        return 0;
+    }
+    for (word = environ; *word != NULL; word++) {
+        total += strlen(*word) + 1 + sizeof(char *);
+    }
+    if (total > limit) {
+        printf("%s: argument list too long (%zu bytes, limit %zu)\n", newCommand->command, total, limit);
+        fflush(stdout);
+        return 1;
+    }
+    return 0;
+}
+
+pid_t launchCommand(struct sh_command *newCommand) {
+    /*
+    Start an external command with the engine selected at startup
+    :param: command struct
+    :retrn: child PID, or -1 if the command could not be started
+    */
+    pid_t childPID;
+
+    // resolve bare names once through the path cache, skipping the fork entirely when nothing matches
+    if (traceFile != NULL) {
+        newCommand->lookupStart = nowNanos();
+    }
+    newCommand->execPath = lookupCommand(newCommand->command);
+    if (traceFile != NULL) {
+        newCommand->lookupEnd = nowNanos();
+    }
+    if (newCommand->execPath == NULL && strchr(newCommand->command, '/') == NULL) {
+        printf("%s: no such file or directory\n", newCommand->command);
+        fflush(stdout);
+        return -1;
+    }
+    if (argsTooLong(newCommand) == 1) {
+        return -1;
+    }
+
+    if (traceFile != NULL) {
+        newCommand->forkStart = nowNanos();
+    }
+    // posix_spawn has no attributes for placement, such commands are forked
+    if (spawnMode == SPAWN_POSIX && newCommand->place == NULL) {
+        childPID = spawnCommand(newCommand);
+    } else {
+        childPID = forkCommand(newCommand);
+    }
+    // the fork engine stamps its own end before collecting the child's pre-exec time
+    if (traceFile != NULL && newCommand->forkEnd == 0) {
+        newCommand->forkEnd = nowNanos();
+    }
+    return childPID;
+}
+
+pid_t launchPipeline(struct sh_pipeline *pipeline, pid_t *pids) {
+    /*
+    Start every stage of the pipeline at once, connected by pipes and sharing one process group
+    :param: pipeline struct, array to receive each stage's PID (-1 for stages that could not start)
+    :retrn: the job's process group, -1 if no stage started
+    */
+    struct sh_command *stage;
+    struct sh_placement effective;
+    struct sh_placement *place = jobPlacement(pipeline, &effective);
+    pid_t pgid = listGroup;
+    int started = 0;
+    int prevRead = -1;
+    int i = 0;
+
+    for (stage = pipeline->first; stage != NULL; stage = stage->next, i++) {
+        stage->place = place;
+        int fds[2] = {-1, -1};
+        // close-on-exec keeps each child from holding other stages' pipe ends open
+        if (stage->next != NULL && pipe2(fds, O_CLOEXEC) == -1) {
+            perror("Cannot create pipe");
+            fds[0] = -1;
+            fds[1] = -1;
+        }
+        stage->pipeIn = prevRead;
+        stage->pipeOut = fds[1];
+        // the first stage's stdin may be supplied (fd 0 never is)
+        if (stage == pipeline->first && pipeline->inputFD > 0) {
+            stage->pipeIn = pipeline->inputFD;
+        }
+        // the last stage's stdout may be captured (fd 0 is never a capture target)
+        if (stage->next == NULL && pipeline->captureFD > 0) {
+            stage->pipeOut = pipeline->captureFD;
+        }
+        stage->errFD = pipeline->captureErr == 1 ? pipeline->captureFD : -1;
+        stage->pgid = pgid;
+        stage->background = pipeline->background;
+
+        pids[i] = launchCommand(stage);
+        if (pids[i] != -1) {
+            started++;
+            if (pgid == 0) {
+                pgid = pids[i];
+            }
+            // set from both sides so the group exists before either one relies on it
+            setpgid(pids[i], pgid);
+        }
+
+        // the parent keeps only the read end waiting for the next stage
+        if (prevRead != -1) {
+            close(prevRead);
+        }
+        if (fds[1] != -1) {
+            close(fds[1]);
+        }
+        prevRead = fds[0];
+    }
+    if (prevRead != -1) {
+        close(prevRead);
+    }
+    return started == 0 ? -1 : pgid;
+}
+
+void reportStatus(int waitStatus, pid_t pid, int background) {
+    /*
+    Store a finished job's status in statusVar and print the matching notice
+    :param: raw wait status of the job's last stage, PID to report, background bool
+    */
+    statusTimedOut = 0;
+    // exited normally
+    if (WIFEXITED(waitStatus)) {
+        // fix statusVar format
+        statusVar = WEXITSTATUS(waitStatus);
+        if (background == 1) {
+            printf("Background process %d ended, exit value %d\n", pid, statusVar);
+            fflush(stdout);
+        }
+    // terminated abnormally
+    } else {
+        // fix statusVar format
+        statusVar = WTERMSIG(waitStatus);
+        if (background == 1) {
+            printf("Background process %d ended, terminated with signal %d\n", pid, statusVar);
+        } else {
+            printf("Process %d ended, terminated with signal %d\n", pid, statusVar);
+        }
+        fflush(stdout);
+    }
+}
+
+void reportJob(struct sh_job *job, pid_t pid, int background) {
+    /*
+    Store a finished job's status and print its notice - a job that ran out of time reports that instead, with
+    status 124 like timeout(1)
+    :param: job, PID to report, background bool
+    */
+    if (job->timedOut == 0) {
+        reportStatus(job->status, pid, background);
+        return;
+    }
+    printf("%s %d timed out after %gs, ", background == 1 ? "Background process" : "Process", pid, job->timeout);
+    if (WIFEXITED(job->status)) {
+        printf("exit value %d\n", WEXITSTATUS(job->status));
+    } else {
+        printf("terminated with signal %d\n", WTERMSIG(job->status));
+    }
+    fflush(stdout);
+    statusVar = TIMEOUT_STATUS;
+    statusTimedOut = 1;
+}
+
+void elapsedSince(struct timespec *start, struct timespec *end, double *secs) {
+    /*
+    Seconds between two monotonic timestamps
+    :param: start, end, result
+    */
+    *secs = (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void printTimes(FILE *out, double real, struct rusage *usage) {
+    /*
+    Print one job's timing and resource use on a single line
+    :param: stream, wall seconds, rusage summed over the job's processes
+    */
+    fprintf(out, "real %.3fs user %.3fs sys %.3fs maxrss %ldK csw %ld/%ld",
+            real,
+            usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6,
+            usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6,
+            usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+struct sh_job *newJob(struct sh_pipeline *pipeline) {
+    /*
+    Append an entry for a pipeline to the job table, not yet started
+    :param: pipeline
+    :retrn: new job
+    */
+    struct sh_job *job = calloc(1, sizeof(struct sh_job));
+    struct sh_job **link = &jobList;
+
+    // next number after the highest one in use, appended so the list stays in job order
+    job->id = 1;
+    while (*link != NULL) {
+        job->id = (*link)->id + 1;
+        link = &(*link)->next;
+    }
+    *link = job;
+
+    job->background = pipeline->background;
+    job->timed = pipeline->timed;
+    job->text = strdup(pipeline->text);
+    clock_gettime(CLOCK_MONOTONIC, &job->submitted);
+    return job;
+}
+
+void jobStarted(struct sh_job *job, pid_t pgid, pid_t *pids, int count, struct sh_pipeline *pipeline) {
+    /*
+    Record the processes of a job's launched pipeline so its stages can be reaped and reported as one job
+    :param: job, process group, stage PIDs, stage count, pipeline it came from
+    */
+    double limit;
+    int i;
+
+    job->pgid = pgid;
+    job->count = count;
+    job->pids = malloc(count * sizeof(pid_t));
+    memcpy(job->pids, pids, count * sizeof(pid_t));
+    for (i = 0; i < count; i++) {
+        if (pids[i] != -1) {
+            job->live++;
+        }
+    }
+    job->lastPID = pids[count - 1];
+    // a last stage that never started counts as a failed command
+    job->status = W_EXITCODE(1, 0);
+    job->state = JOB_RUNNING;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    if (traceFile != NULL) {
+        job->trace = traceLaunch(pipeline);
+    }
+    // the clock starts once the job runs, time spent queued doesn't count
+    limit = pipeline->timeout != 0 ? pipeline->timeout : defaultDeadline;
+    if (limit > 0) {
+        job->timeout = limit;
+        job->grace = pipeline->grace > 0 ? pipeline->grace : KILL_GRACE;
+        job->deadline = nowNanos() + (long long) (limit * 1e9);
+    }
+}
+
+struct sh_job *addJob(pid_t pgid, pid_t *pids, int count, struct sh_pipeline *pipeline) {
+    /*
+    Record a launched pipeline in the job table
+    :param: process group, stage PIDs, stage count, pipeline it came from
+    :retrn: new job
+    */
+    struct sh_job *job = newJob(pipeline);
+    jobStarted(job, pgid, pids, count, pipeline);
+    return job;
+}
+
+void dropKept(struct sh_output **link) {
+    /*
+    Unlink and free one kept output, with a notice when nobody has read it
+    :param: link to it
+    */
+    struct sh_output *kept = *link;
+
+    if (kept->ring.unread == 1) {
+        printf("[%d] unread output dropped (%zu bytes), kept output is limited to %dM\n", kept->id, kept->ring.len,
+               KEPT_OUTPUT_MAX >> 20);
+        fflush(stdout);
+        noticePrinted = 1;
+    }
+    *link = kept->next;
+    keptBytes -= kept->ring.len;
+    free(kept->ring.data);
+    free(kept);
+}
+
+void trimOutput(void) {
+    /*
+    Drop the oldest kept output that has been read once more than MAX_DONE_JOBS of those pile up, then the
+    oldest of any kind while the total is over KEPT_OUTPUT_MAX
+    */
+    struct sh_output **link;
+    struct sh_output *kept;
+    int read = 0;
+
+    for (kept = keptOutput; kept != NULL; kept = kept->next) {
+        read += kept->ring.unread == 0;
+    }
+    for (link = &keptOutput; *link != NULL && (read > MAX_DONE_JOBS || keptBytes > KEPT_OUTPUT_MAX);) {
+        if ((*link)->ring.unread == 1) {
+            link = &(*link)->next;
+            continue;
+        }
+        dropKept(link);
+        read--;
+    }
+    while (keptBytes > KEPT_OUTPUT_MAX && keptOutput != NULL) {
+        dropKept(&keptOutput);
+    }
+}
+
+void keepOutput(struct sh_job *job) {
+    /*
+    Take over the captured output of a finished job, copied down to the bytes it holds, so output can still show
+    it once the job has left the table
+    :param: job
+    */
+    struct sh_ring *ring = &job->output;
+    struct sh_output *kept;
+    struct sh_output **link = &keptOutput;
+    size_t first;
+
+    if (ring->data == NULL) {
+        return;
+    }
+    kept = malloc(sizeof(struct sh_output));
+    kept->id = job->id;
+    kept->pgid = job->pgid;
+    kept->ring = *ring;
+    kept->ring.data = malloc(ring->len > 0 ? ring->len : 1);
+    kept->ring.size = ring->len;
+    kept->ring.start = 0;
+    kept->next = NULL;
+    // oldest bytes first, the ring may wrap
+    first = ring->size - ring->start < ring->len ? ring->size - ring->start : ring->len;
+    memcpy(kept->ring.data, ring->data + ring->start, first);
+    memcpy(kept->ring.data + first, ring->data, ring->len - first);
+    free(ring->data);
+    ring->data = NULL;
+    keptBytes += kept->ring.len;
+    while (*link != NULL) {
+        link = &(*link)->next;
+    }
+    *link = kept;
+    trimOutput();
+}
+
+void freeJob(struct sh_job *job) {
+    /*
+    Unlink a job from the table and release it
+    :param: job
+    */
+    struct sh_job **link = &jobList;
+    while (*link != NULL && *link != job) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = job->next;
+    }
+    if (job->pending != NULL) {
+        arenaFree(&job->pending->arena);
+        free(job->pending);
+        queuedJobs--;
+    } else if (job->pendingList != NULL) {
+        queuedJobs--;
+    }
+    if (job->outFD > 0) {
+        close(job->outFD);
+    }
+    keepOutput(job);
+    free(job->pids);
+    free(job->text);
+    free(job->trace);
+    free(job);
+}
+
+void ringWrite(struct sh_ring *ring, char *data, size_t len) {
+    /*
+    Append to a ring buffer, overwriting the oldest bytes once it is full
+    :param: ring, bytes, count
+    */
+    size_t end;
+    size_t first;
+
+    if (ring->data == NULL) {
+        ring->data = malloc(ring->size);
+    }
+    // only the newest bytes of a write larger than the ring can survive
+    if (len > ring->size) {
+        ring->dropped += len - ring->size;
+        data += len - ring->size;
+        len = ring->size;
+    }
+    if (ring->len + len > ring->size) {
+        size_t over = ring->len + len - ring->size;
+        ring->dropped += over;
+        ring->start = (ring->start + over) % ring->size;
+        ring->len -= over;
+    }
+    end = (ring->start + ring->len) % ring->size;
+    first = ring->size - end < len ? ring->size - end : len;
+    memcpy(ring->data + end, data, first);
+    memcpy(ring->data, data + first, len - first);
+    ring->len += len;
+    ring->unread = 1;
+}
+
+int writeAll(int fd, char *data, size_t len) {
+    /*
+    write() until everything is out, across short writes and signals
+    :param: descriptor, bytes, count
+    :retrn: 0, -1 on error
+    */
+    while (len > 0) {
+        ssize_t done = write(fd, data, len);
+        if (done == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += done;
+        len -= done;
+    }
+    return 0;
+}
+
+int ringSave(struct sh_ring *ring, int fd) {
+    /*
+    Write a ring buffer's contents out, oldest first
+    :param: ring, descriptor
+    :retrn: 0, -1 when a write failed
+    */
+    size_t first = ring->size - ring->start < ring->len ? ring->size - ring->start : ring->len;
+    if (ring->len == 0) {
+        return 0;
+    }
+    if (writeAll(fd, ring->data + ring->start, first) == -1 || writeAll(fd, ring->data, ring->len - first) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+int captureStart(struct sh_pipeline *pipeline) {
+    /*
+    With bgoutput capture or spill, give an & job a pipe for its stdout and stderr
+    :param: pipeline about to launch
+    :retrn: non-blocking read end for the job, -1 when output is discarded
+    */
+    int fds[2];
+    if (bgOutput == BGOUT_DISCARD || pipeline->background == 0 || pipeline->captureFD > 0) {
+        return -1;
+    }
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("Cannot create pipe");
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    pipeline->captureFD = fds[1];
+    pipeline->captureErr = 1;
+    return fds[0];
+}
+
+void captureAttach(struct sh_job *job, struct sh_pipeline *pipeline, int readFD) {
+    /*
+    The job has launched (job is NULL when it failed to) - keep the read end of its output pipe with it
+    :param: job, its pipeline, read end from captureStart
+    */
+    if (readFD == -1) {
+        return;
+    }
+    // only the children hold the write end now, EOF comes when the last one lets go
+    close(pipeline->captureFD);
+    pipeline->captureFD = 0;
+    pipeline->captureErr = 0;
+    if (job == NULL) {
+        close(readFD);
+        return;
+    }
+    job->outFD = readFD;
+    job->output.size = ringSize;
+}
+
+void spillOutput(struct sh_job *job) {
+    /*
+    bgoutput spill - write a finished job's captured output to a file in the spill directory
+    :param: job
+    */
+    char path[PATH_MAX];
+    int fd;
+
+    if (bgOutput != BGOUT_SPILL || job->output.len == 0) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/smallsh-%d.out", spillDir, job->pgid);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || ringSave(&job->output, fd) == -1) {
+        printf("Cannot save output of [%d] to %s: %s\n", job->id, path, strerror(errno));
+    } else {
+        printf("[%d] output saved to %s\n", job->id, path);
+        job->output.unread = 0;
+    }
+    fflush(stdout);
+    if (fd != -1) {
+        close(fd);
+    }
+    noticePrinted = 1;
+}
+
+void drainOutput(struct sh_job *job) {
+    /*
+    Move whatever a job's output pipe holds into its ring without blocking. At EOF the pipe is closed, and a
+    finished job's output is spilled
+    :param: job with an output pipe
+    */
+    char buf[16384];
+    ssize_t got;
+
+    while ((got = read(job->outFD, buf, sizeof(buf))) > 0) {
+        ringWrite(&job->output, buf, got);
+    }
+    if (got == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close(job->outFD);
+        job->outFD = 0;
+        if (job->state == JOB_DONE) {
+            spillOutput(job);
+            keepOutput(job);
+        }
+    }
+}
+
+int runningJobs(void) {
+    /*
+    Count the & jobs holding a slot - running or stopped
+    :retrn: count
+    */
+    struct sh_job *job;
+    int n = 0;
+    for (job = jobList; job != NULL; job = job->next) {
+        if (job->background == 1 && (job->state == JOB_RUNNING || job->state == JOB_STOPPED)) {
+            n++;
+        }
+    }
+    return n;
+}
+
+pid_t forkList(struct sh_node *node, struct sh_pipeline *job, int *outRead);
+int startQueued(struct sh_job *job) {
+    /*
+    Launch a queued job now, announcing it like any & job
+    :param: queued job
+    :retrn: 0, -1 when it could not start (it is dropped)
+    */
+    struct sh_pipeline *pipeline = job->pending;
+
+    if (job->pendingList != NULL) {
+        struct sh_pipeline list = {0};
+        int outRead;
+        pid_t pid;
+
+        list.background = 1;
+        list.count = 1;
+        list.text = job->text;
+        pid = forkList(job->pendingList, &list, &outRead);
+        if (pid == -1) {
+            statusVar = 1;
+            freeJob(job);
+            return -1;
+        }
+        job->pendingList = NULL;
+        queuedJobs--;
+        jobStarted(job, pid, &pid, 1, &list);
+        captureAttach(job, &list, outRead);
+        lastBgPID = pid;
+        printf("Background PID is %d\n", pid);
+        fflush(stdout);
+        return 0;
+    }
+
+    pid_t *pids = malloc(pipeline->count * sizeof(pid_t));
+    int outRead = captureStart(pipeline);
+    pid_t pgid = launchPipeline(pipeline, pids);
+
+    if (pgid == -1) {
+        captureAttach(NULL, pipeline, outRead);
+        statusVar = 1;
+        free(pids);
+        freeJob(job);
+        return -1;
+    }
+    jobStarted(job, pgid, pids, pipeline->count, pipeline);
+    captureAttach(job, pipeline, outRead);
+    job->pending = NULL;
+    queuedJobs--;
+    arenaFree(&pipeline->arena);
+    free(pipeline);
+
+    lastBgPID = pids[job->count - 1] != -1 ? pids[job->count - 1] : pgid;
+    printf("Background PID is %d\n", pgid);
+    fflush(stdout);
+    free(pids);
+    return 0;
+}
+
+void startQueue(void) {
+    /*
+    Start queued jobs, oldest first, while there are free slots
+    */
+    struct sh_job *job = jobList;
+    int running;
+
+    if (queuedJobs == 0) {
+        return;
+    }
+    running = runningJobs();
+    while (job != NULL && (maxJobs == 0 || running < maxJobs)) {
+        struct sh_job *next = job->next;
+        if (job->state == JOB_QUEUED && startQueued(job) == 0) {
+            running++;
+            noticePrinted = 1;
+        }
+        job = next;
+    }
+}
+
+void finishJob(struct sh_job *job) {
+    /*
+    Last process of a job is gone - stamp it done and, in the background, announce it straight away
+    :param: job
+    */
+    // collect the last of its output, the pipe normally reaches EOF now
+    if (job->outFD > 0) {
+        drainOutput(job);
+    }
+    job->state = JOB_DONE;
+    clock_gettime(CLOCK_MONOTONIC, &job->end);
+    if (job->trace != NULL) {
+        traceFinish(job);
+    }
+    if (job->background == 1) {
+        reportJob(job, job->pgid, 1);
+        if (job->timed == 1) {
+            double real;
+            elapsedSince(&job->start, &job->end, &real);
+            printTimes(stderr, real, &job->usage);
+            fprintf(stderr, "\n");
+        }
+        noticePrinted = 1;
+        doneJobs++;
+    }
+    // output still arriving (from a process that outlived the job) is spilled at EOF instead
+    if (job->outFD == 0) {
+        spillOutput(job);
+        keepOutput(job);
+    }
+
+    // finished background jobs stay listed for jobs/wait, drop the oldest once too many pile up
+    if (doneJobs > MAX_DONE_JOBS) {
+        struct sh_job *old = jobList;
+        while (old != NULL && (old->state != JOB_DONE || old->background == 0)) {
+            old = old->next;
+        }
+        if (old != NULL) {
+            freeJob(old);
+            doneJobs--;
+        }
+    }
+}
+
+void reapChildren(void) {
+    /*
+    Collect every child that exited, stopped, or continued without blocking, charging its rusage to its job.
+    Background jobs are announced as soon as their last process is gone
+    */
+    pid_t checkAll;
+    int waitStatus;
+    struct rusage usage;
+    // -1 checks for any changed children, wait4 returns > 0 when found, WNOHANG doesn't wait
+    while ((checkAll = wait4(-1, &waitStatus, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        struct sh_job *job;
+        int i = 0;
+        for (job = jobList; job != NULL; job = job->next) {
+            for (i = 0; i < job->count && job->pids[i] != checkAll; i++);
+            if (i < job->count) {
+                break;
+            }
+        }
+        if (job == NULL) {
+            continue;
+        }
+
+        if (WIFSTOPPED(waitStatus)) {
+            job->state = JOB_STOPPED;
+            job->status = waitStatus;
+            continue;
+        }
+        if (WIFCONTINUED(waitStatus)) {
+            job->state = JOB_RUNNING;
+            continue;
+        }
+
+        // exited or killed - add its resource use to the job
+        timeradd(&job->usage.ru_utime, &usage.ru_utime, &job->usage.ru_utime);
+        timeradd(&job->usage.ru_stime, &usage.ru_stime, &job->usage.ru_stime);
+        if (usage.ru_maxrss > job->usage.ru_maxrss) {
+            job->usage.ru_maxrss = usage.ru_maxrss;
+        }
+        job->usage.ru_nvcsw += usage.ru_nvcsw;
+        job->usage.ru_nivcsw += usage.ru_nivcsw;
+
+        // the last stage's status is the job's status
+        if (i == job->count - 1) {
+            job->status = waitStatus;
+        }
+        // a PID is never zero, so a reaped stage can't match again
+        job->pids[i] = 0;
+        if (--job->live == 0) {
+            finishJob(job);
+        }
+    }
+    // slots freed up, queued & jobs move in
+    startQueue();
+}
+
+int deadlineTimer(void) {
+    /*
+    The deadline timerfd, created on first use
+    :retrn: descriptor, -1 if it can't be created
+    */
+    if (deadlineFD == -1) {
+        deadlineFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (deadlineFD == -1) {
+            perror("timerfd_create()");
+        }
+    }
+    return deadlineFD;
+}
+
+void armDeadlines(void) {
+    /*
+    Point the deadline timer at the nearest SIGTERM or SIGKILL any running or stopped job is due, or disarm it
+    */
+    struct sh_job *job;
+    struct itimerspec when = {{0, 0}, {0, 0}};
+    long long next = 0;
+
+    for (job = jobList; job != NULL; job = job->next) {
+        long long due = job->timedOut == 1 ? job->killAt : job->deadline;
+        if ((job->state == JOB_RUNNING || job->state == JOB_STOPPED) && due > 0 && (next == 0 || due < next)) {
+            next = due;
+        }
+    }
+    if (next == armedAt) {
+        return;
+    }
+    if (deadlineTimer() == -1) {
+        return;
+    }
+    // an absolute time already past fires at once, zero disarms
+    when.it_value.tv_sec = next / 1000000000;
+    when.it_value.tv_nsec = next % 1000000000;
+    if (timerfd_settime(deadlineFD, TFD_TIMER_ABSTIME, &when, NULL) == 0) {
+        armedAt = next;
+    }
+}
+
+void signalJob(struct sh_job *job, int sig) {
+    /*
+    Send a signal to a job's process group - or, in a copy of the shell whose commands join the copy's own group
+    (listGroup), to each of the job's live processes, so the copy survives its commands' deadlines
+    :param: job, signal
+    */
+    int i;
+
+    if (listGroup == 0 || job->pgid != listGroup) {
+        killpg(job->pgid, sig);
+        return;
+    }
+    for (i = 0; i < job->count; i++) {
+        if (job->pids[i] > 0) {
+            kill(job->pids[i], sig);
+        }
+    }
+}
+
+void expireDeadlines(void) {
+    /*
+    Signal every job whose time is up - SIGTERM to the process group at the deadline, SIGKILL after its grace
+    */
+    struct sh_job *job;
+    uint64_t expirations;
+    long long now = nowNanos();
+
+    while (read(deadlineFD, &expirations, sizeof(expirations)) == sizeof(expirations));
+    armedAt = 0;
+    for (job = jobList; job != NULL; job = job->next) {
+        if (job->state != JOB_RUNNING && job->state != JOB_STOPPED) {
+            continue;
+        }
+        if (job->timedOut == 0 && job->deadline > 0 && job->deadline <= now) {
+            job->timedOut = 1;
+            job->killAt = now + (long long) (job->grace * 1e9);
+            signalJob(job, SIGTERM);
+            // a stopped job has to run to act on the SIGTERM
+            if (job->state == JOB_STOPPED) {
+                signalJob(job, SIGCONT);
+            }
+        } else if (job->timedOut == 1 && job->killAt > 0 && job->killAt <= now) {
+            job->killAt = 0;
+            signalJob(job, SIGKILL);
+        }
+    }
+}
+
+int waitEvents(int fd) {
+    /*
+    Sleep in poll until fd has input or a child changes state, reaping children as they exit
+    :param: descriptor to watch for input, -1 to wait for children only
+    :retrn: 1 when fd is readable, 0 after child events, -1 when a signal interrupted the wait or a background
+            notice was printed over the prompt
+    */
+    // the child, input and deadline descriptors, then the output pipe of every captured job
+    static struct pollfd *fds = NULL;
+    static int cap = 0;
+    struct sh_job *job;
+    int n = 0;
+    int outputs;
+
+    for (job = jobList; job != NULL; job = job->next) {
+        if (job->outFD > 0) {
+            n++;
+        }
+    }
+    if (n + 3 > cap) {
+        cap = n + 8;
+        fds = realloc(fds, cap * sizeof(struct pollfd));
+    }
+    n = 0;
+    fds[n].fd = childFD;
+    fds[n].events = POLLIN;
+    n++;
+    fds[n].fd = fd;
+    fds[n].events = POLLIN;
+    n++;
+    armDeadlines();
+    fds[n].fd = armedAt > 0 ? deadlineFD : -1;
+    fds[n].events = POLLIN;
+    n++;
+    for (job = jobList; job != NULL; job = job->next) {
+        if (job->outFD > 0) {
+            fds[n].fd = job->outFD;
+            fds[n].events = POLLIN;
+            n++;
+        }
+    }
+
+    // poll skips the negative input and deadline descriptors
+    if (poll(fds, n, -1) == -1) {
+        return errno == EINTR ? -1 : 0;
+    }
+
+    // output first, reaping can drop jobs from the table
+    outputs = 3;
+    for (job = jobList; job != NULL && outputs < n; job = job->next) {
+        if (job->outFD > 0 && job->outFD == fds[outputs].fd) {
+            if (fds[outputs].revents != 0) {
+                drainOutput(job);
+            }
+            outputs++;
+        }
+    }
+
+    if (fds[2].revents & POLLIN) {
+        expireDeadlines();
+    }
+
+    if (fds[0].revents & POLLIN) {
+        // signalfd coalesces SIGCHLDs, drain it and let wait4 find every changed child
+        struct signalfd_siginfo info;
+        while (read(childFD, &info, sizeof(info)) == sizeof(info));
+        noticePrinted = 0;
+        reapChildren();
+        if (noticePrinted == 1 && fd >= 0) {
+            return -1;
+        }
+    }
+    if (fd >= 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+        return 1;
+    }
+    return 0;
+}
+
+void waitJob(struct sh_job *job) {
+    /*
+    Wait in the foreground for a job through the event loop until it finishes or stops, status comes from the
+    last stage. Background jobs finishing meanwhile are reaped and announced too
+    :param: job
+    */
+    job->background = 0;
+    while (job->state == JOB_RUNNING) {
+        waitEvents(-1);
+    }
+
+    // take the terminal back for the prompt
+    if (jobControl == 1) {
+        tcsetpgrp(STDIN_FILENO, shellPGID);
+    }
+
+    // stopped by a signal, it waits in the job table for fg or bg
+    if (job->state == JOB_STOPPED) {
+        job->background = 1;
+        statusVar = WSTOPSIG(job->status);
+        printf("[%d] Stopped (signal %d) %s\n", job->id, statusVar, job->text);
+        fflush(stdout);
+        return;
+    }
+
+    reportJob(job, job->lastPID, 0);
+    if (job->timed == 1) {
+        double real;
+        elapsedSince(&job->start, &job->end, &real);
+        printTimes(stderr, real, &job->usage);
+        fprintf(stderr, "\n");
+    }
+    freeJob(job);
+}
+
+struct sh_job *findJob(char *spec) {
+    /*
+    Look up a job by %n, %% / %+ (current job), or process group number
+    :param: job spec, NULL for the current job
+    :retrn: job, NULL if there is no such job
+    */
+    struct sh_job *job;
+    struct sh_job *current = NULL;
+
+    // the current job is the newest one still running or stopped
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        for (job = jobList; job != NULL; job = job->next) {
+            if (job->state != JOB_DONE) {
+                current = job;
+            }
+        }
+        return current;
+    }
+
+    int byID = spec[0] == '%';
+    char *end;
+    long n = strtol(byID ? spec + 1 : spec, &end, 10);
+    if (*end != '\0') {
+        return NULL;
+    }
+    for (job = jobList; job != NULL; job = job->next) {
+        if ((byID && job->id == n) || (!byID && job->pgid == n && n > 0)) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+void printJobs(void) {
+    /*
+    List the job table - state, process group, elapsed time, rusage so far, and command line.
+    Finished jobs are listed once, then dropped
+    */
+    struct sh_job *job = jobList;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    while (job != NULL) {
+        struct sh_job *next = job->next;
+        char state[32];
+        double real;
+
+        if (job->state == JOB_QUEUED) {
+            // waiting so far instead of run time
+            elapsedSince(&job->submitted, &now, &real);
+            printf("[%d] %-10s %-7s real %.3fs  %s\n", job->id, "Queued", "-", real, job->text);
+            job = next;
+            continue;
+        }
+        if (job->state == JOB_RUNNING) {
+            strcpy(state, "Running");
+        } else if (job->state == JOB_STOPPED) {
+            strcpy(state, "Stopped");
+        } else if (job->timedOut == 1) {
+            strcpy(state, "Timeout");
+        } else if (WIFEXITED(job->status)) {
+            sprintf(state, "Done(%d)", WEXITSTATUS(job->status));
+        } else {
+            sprintf(state, "Signal(%d)", WTERMSIG(job->status));
+        }
+        elapsedSince(&job->start, job->state == JOB_DONE ? &job->end : &now, &real);
+
+        printf("[%d] %-10s %-7d ", job->id, state, job->pgid);
+        fflush(stdout);
+        printTimes(stdout, real, &job->usage);
+        if (job->queued == 1) {
+            elapsedSince(&job->submitted, &job->start, &real);
+            printf("  queued %.3fs", real);
+        }
+        printf("  %s\n", job->text);
+
+        if (job->state == JOB_DONE) {
+            freeJob(job);
+            doneJobs--;
+        }
+        job = next;
+    }
+    fflush(stdout);
+}
+
+void waitBuiltIn(char *spec) {
+    /*
+    wait [%n] - block until the job (or every background job) is done, statusVar takes its status
+    :param: job spec, NULL for all jobs
+    */
+    struct sh_job *job;
+    if (spec != NULL) {
+        job = findJob(spec);
+        if (job == NULL) {
+            printf("wait: no such job %s\n", spec);
+            fflush(stdout);
+            statusVar = 1;
+            return;
+        }
+        // a queued job starts once a running one ends, unless only stopped jobs hold the slots
+        while (job->state == JOB_RUNNING || job->state == JOB_QUEUED) {
+            struct sh_job *running;
+            for (running = jobList; running != NULL && running->state != JOB_RUNNING; running = running->next);
+            if (running == NULL) {
+                printf("wait: %%%d is queued behind stopped jobs\n", job->id);
+                fflush(stdout);
+                statusVar = 1;
+                return;
+            }
+            waitEvents(-1);
+        }
+        statusVar = WIFEXITED(job->status) ? WEXITSTATUS(job->status) : WTERMSIG(job->status);
+        statusTimedOut = job->timedOut;
+        if (job->timedOut == 1) {
+            statusVar = TIMEOUT_STATUS;
+        }
+        return;
+    }
+
+    // every running background job
+    while (1) {
+        for (job = jobList; job != NULL && job->state != JOB_RUNNING; job = job->next);
+        if (job == NULL) {
+            break;
+        }
+        waitEvents(-1);
+    }
+    // the jobs' notices set $? as they ended, waiting for all of them succeeds
+    statusVar = 0;
+    statusTimedOut = 0;
+}
+
+void continueJob(char *spec, int foreground) {
+    /*
+    fg / bg - resume a job, in the foreground with the terminal or in the background
+    :param: job spec (NULL for the current job), foreground bool
+    */
+    char *name = foreground == 1 ? "fg" : "bg";
+    struct sh_job *job = findJob(spec);
+    if (job == NULL || job->state == JOB_DONE) {
+        printf("%s: no such job\n", name);
+        fflush(stdout);
+        statusVar = 1;
+        return;
+    }
+
+    // a queued job skips the rest of the queue
+    if (job->state == JOB_QUEUED && startQueued(job) == -1) {
+        return;
+    }
+    printf("%s\n", job->text);
+    fflush(stdout);
+    if (foreground == 1 && jobControl == 1) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    if (job->state == JOB_STOPPED) {
+        killpg(job->pgid, SIGCONT);
+        job->state = JOB_RUNNING;
+    }
+    if (foreground == 1) {
+        waitJob(job);
+    } else {
+        job->background = 1;
+    }
+}
+
+void killJobs(void) {
+    /*
+    Terminate every unfinished job's process group before the shell exits, stopped ones need a SIGCONT to see it
+    */
+    struct sh_job *job;
+    for (job = jobList; job != NULL; job = job->next) {
+        // queued jobs have no processes
+        if (job->state != JOB_DONE && job->state != JOB_QUEUED) {
+            killpg(job->pgid, SIGTERM);
+            if (job->state == JOB_STOPPED) {
+                killpg(job->pgid, SIGCONT);
+            }
+        }
+    }
+}
+
+void runPipeline(struct sh_pipeline *pipeline) {
+    /*
+    Launch a parsed pipeline as a job, then wait for it in the foreground or leave it in the background.
+    An & job beyond maxjobs is queued behind the others instead
+    :param: pipeline struct
+    */
+    if (pipeline->background == 1 && maxJobs > 0 && (queuedJobs > 0 || runningJobs() >= maxJobs)) {
+        struct sh_job *job = newJob(pipeline);
+        job->state = JOB_QUEUED;
+        job->queued = 1;
+        job->pending = clonePipeline(pipeline);
+        queuedJobs++;
+        printf("Queued job [%d], %d waiting\n", job->id, queuedJobs);
+        fflush(stdout);
+        return;
+    }
+
+    pid_t *pids = malloc(pipeline->count * sizeof(pid_t));
+    int outRead = captureStart(pipeline);
+    pid_t pgid = launchPipeline(pipeline, pids);
+
+    // command never started, report failure like a child that could not exec
+    if (pgid == -1) {
+        captureAttach(NULL, pipeline, outRead);
+        statusVar = 1;
+        free(pids);
+        return;
+    }
+
+    struct sh_job *job = addJob(pgid, pids, pipeline->count, pipeline);
+    captureAttach(job, pipeline, outRead);
+    // foreground: wait for every stage and store statusVar
+    if (pipeline->background == 0) {
+        waitJob(job);
+    } else {
+        // $! names the last stage, like sh
+        lastBgPID = pids[pipeline->count - 1] != -1 ? pids[pipeline->count - 1] : pgid;
+        // print background PID
+        printf("Background PID is %d\n", pgid);
+        fflush(stdout);
+    }
+    free(pids);
+}
+
+void initReader(struct line_reader *r, int fd) {
+    /*
+    Prepare a reader that pulls large blocks from a file descriptor
+    :param: reader struct, descriptor to read
+    */
+    r->fd = fd;
+    r->cap = READER_BUFSIZE;
+    r->buf = malloc(r->cap + 1);
+    r->start = 0;
+    r->end = 0;
+    r->eof = 0;
+}
+
+void initStringReader(struct line_reader *r, char *text) {
+    /*
+    Prepare a reader over a fixed string, used for -c
+    :param: reader struct, command text
+    */
+    size_t len = strlen(text);
+    r->fd = -1;
+    r->cap = len;
+    r->buf = malloc(len + 1);
+    memcpy(r->buf, text, len);
+    r->start = 0;
+    r->end = len;
+    r->eof = 1;
+}
+
+char *readLine(struct line_reader *r) {
+    /*
+    Return the next line with its newline stripped, refilling the buffer with one read() per block rather than per line
+    :param: reader struct
+    :retrn: line inside the reader's buffer (valid until the next call), "" when a signal interrupted the read,
+            NULL at end of input
+    */
+    while (1) {
+        // a complete line is already buffered
+        char *line = r->buf + r->start;
+        char *newline = memchr(line, '\n', r->end - r->start);
+        if (newline != NULL) {
+            *newline = '\0';
+            r->start = newline - r->buf + 1;
+            return line;
+        }
+
+        // last line without a newline
+        if (r->eof == 1) {
+            if (r->start == r->end) {
+                return NULL;
+            }
+            r->buf[r->end] = '\0';
+            r->start = r->end;
+            return line;
+        }
+
+        // slide the partial line to the front, grow only when one line fills the whole buffer
+        if (r->start > 0) {
+            memmove(r->buf, r->buf + r->start, r->end - r->start);
+            r->end -= r->start;
+            r->start = 0;
+        }
+        if (r->end == r->cap) {
+            r->cap *= 2;
+            r->buf = realloc(r->buf, r->cap + 1);
+        }
+
+        // sleep until input arrives, announcing children that finish in the meantime
+        int ready = waitEvents(r->fd);
+        if (ready == -1) {
+            // interrupted (i.e. SIGTSTP) or a notice was printed, hand back an empty line so the prompt is shown again
+            return "";
+        } else if (ready == 0) {
+            continue;
+        }
+
+        ssize_t got = read(r->fd, r->buf + r->end, r->cap - r->end);
+        if (got > 0) {
+            r->end += got;
+        } else if (got == 0) {
+            r->eof = 1;
+        } else if (errno == EINTR) {
+            return "";
+        } else {
+            r->eof = 1;
+        }
+    }
+}
+
+int compoundLine(char *line);
+pid_t shellCopy(char *line, int outFD, int inFD);
+int parallelBuiltIn(struct sh_command *newCommand) {
+    /*
+    parallel [-j N] [-g] [file] - run command lines from a file (or stdin) as tasks, keeping exactly N running
+    and starting the next as each one is reaped. Tasks go through the normal launch path as external commands,
+    lists and other compiled lines run in a copy of the shell. -g holds each task's stdout in memory and prints it in one piece when the task ends
+    :param: parsed command
+    :retrn: number of failed tasks (capped at 255), for statusVar
+    */
+    // one parse arena for tasks, kept across calls
+    static struct sh_pipeline task = {0};
+    struct line_reader fileReader;
+    struct line_reader *tasks = shellInput;
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    int grouped = 0;
+    struct sh_redirect *input = findRedirect(newCommand, 0);
+    char *taskFile = input != NULL && input->kind == REDIR_IN ? input->target : NULL;
+    int i;
+
+    // read options
+    for (i = 1; i < newCommand->argc; i++) {
+        char *arg = newCommand->args[i];
+        if (strcmp(arg, "-g") == 0) {
+            grouped = 1;
+        } else if (strcmp(arg, "-j") == 0 && i + 1 < newCommand->argc) {
+            slots = atol(newCommand->args[++i]);
+        } else if (strncmp(arg, "-j", 2) == 0 && arg[2] != '\0') {
+            slots = atol(arg + 2);
+        } else if (arg[0] != '-' && i == newCommand->argc - 1) {
+            taskFile = arg;
+        } else {
+            printf("usage: parallel [-j N] [-g] [file]\n");
+            fflush(stdout);
+            return 1;
+        }
+    }
+    if (slots < 1) {
+        slots = 1;
+    }
+
+    // tasks come from a file, stdin when the shell reads a script, or the rest of the shell's own input
+    if (taskFile != NULL) {
+        int fd = open(taskFile, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            printf("Cannot open %s for input\n", taskFile);
+            fflush(stdout);
+            return 1;
+        }
+        initReader(&fileReader, fd);
+        tasks = &fileReader;
+    } else if (shellInput->fd != STDIN_FILENO) {
+        initReader(&fileReader, STDIN_FILENO);
+        tasks = &fileReader;
+    }
+
+    struct sh_job **running = calloc(slots, sizeof(struct sh_job *));
+    int *captures = calloc(slots, sizeof(int));
+    int *taskNumbers = calloc(slots, sizeof(int));
+    int live = 0;
+    int taskCount = 0;
+    int failed = 0;
+    int endOfTasks = 0;
+    int list;
+
+    // tasks never take the terminal
+    int savedJobControl = jobControl;
+    jobControl = 0;
+
+    while (endOfTasks == 0 || live > 0) {
+        // fill every free slot
+        while (endOfTasks == 0 && live < slots) {
+            char *line = readLine(tasks);
+            if (line == NULL) {
+                endOfTasks = 1;
+                break;
+            }
+            // blank lines, comments, and an interrupted read start nothing
+            if (line[0] == '\0' || line[0] == '#') {
+                continue;
+            }
+            taskCount++;
+
+            freePipeline(&task);
+            list = compoundLine(line);
+            if (list == 0 && (parseInput(line, &task) == -1 || task.first->argc == 0 || stripPrefixes(&task) == -1)) {
+                failed++;
+                continue;
+            }
+            // tasks run alongside each other, never in the background
+            task.background = 0;
+
+            // find a free slot
+            int slot;
+            for (slot = 0; running[slot] != NULL; slot++);
+            if (grouped == 1) {
+                task.captureFD = memfd_create("parallel", MFD_CLOEXEC);
+            }
+
+            pid_t *pids = malloc((list == 1 ? 1 : task.count) * sizeof(pid_t));
+            pid_t pgid;
+            if (list == 1) {
+                // the whole list is one task
+                task.text = line;
+                task.count = 1;
+                pgid = pids[0] = shellCopy(line, task.captureFD, 0);
+            } else {
+                pgid = launchPipeline(&task, pids);
+            }
+            if (pgid == -1) {
+                failed++;
+                if (task.captureFD > 0) {
+                    close(task.captureFD);
+                }
+            } else {
+                running[slot] = addJob(pgid, pids, task.count, &task);
+                captures[slot] = task.captureFD;
+                taskNumbers[slot] = taskCount;
+                live++;
+            }
+            free(pids);
+            task.captureFD = 0;
+        }
+
+        // collect finished tasks, sleeping in the event loop only when nothing can start
+        int collected = 0;
+        for (i = 0; i < slots; i++) {
+            struct sh_job *job = running[i];
+            if (job == NULL || job->state != JOB_DONE) {
+                continue;
+            }
+            // grouped output comes out in one piece
+            if (captures[i] > 0) {
+                char buf[8192];
+                ssize_t got;
+                lseek(captures[i], 0, SEEK_SET);
+                fflush(stdout);
+                while ((got = read(captures[i], buf, sizeof(buf))) > 0) {
+                    write(STDOUT_FILENO, buf, got);
+                }
+                close(captures[i]);
+                captures[i] = 0;
+            }
+            if (!WIFEXITED(job->status) || WEXITSTATUS(job->status) != 0) {
+                failed++;
+                printf("parallel: task %d failed, %s %d: %s\n", taskNumbers[i],
+                       WIFEXITED(job->status) ? "exit value" : "signal",
+                       WIFEXITED(job->status) ? WEXITSTATUS(job->status) : WTERMSIG(job->status), job->text);
+                fflush(stdout);
+            }
+            freeJob(job);
+            running[i] = NULL;
+            live--;
+            collected++;
+        }
+        if (collected == 0 && live > 0 && (live == slots || endOfTasks == 1)) {
+            waitEvents(-1);
+        }
+    }
+
+    jobControl = savedJobControl;
+    // the shell's own input hit end of file for the tasks only
+    if (tasks == shellInput) {
+        shellInput->eof = 0;
+    } else {
+        if (tasks->fd != STDIN_FILENO) {
+            close(tasks->fd);
+        }
+        free(tasks->buf);
+    }
+    free(running);
+    free(captures);
+    free(taskNumbers);
+    return failed > 255 ? 255 : failed;
+}
+
+char *currentDir(void) {
+    /*
+    The logical working directory - taken once from $PWD when that names the directory we are in (else getcwd),
+    then kept up to date by changeDir
+    :retrn: absolute path, owned by the shell
+    */
+    struct stat here;
+    struct stat named;
+    char *env;
+    char buf[PATH_MAX];
+
+    if (logicalPWD != NULL) {
+        return logicalPWD;
+    }
+    env = getenv("PWD");
+    if (env != NULL && env[0] == '/' && stat(".", &here) == 0 && stat(env, &named) == 0 &&
+        here.st_dev == named.st_dev && here.st_ino == named.st_ino) {
+        logicalPWD = strdup(env);
+    } else if (getcwd(buf, sizeof(buf)) != NULL) {
+        logicalPWD = strdup(buf);
+    } else {
+        logicalPWD = strdup("/");
+    }
+    return logicalPWD;
+}
+
+char *logicalPath(char *base, char *path) {
+    /*
+    Resolve a path against a directory by text alone, like cd -L: . is dropped and .. removes the component
+    before it, so symlinks followed on the way in are also the way back out
+    :param: absolute directory, path to resolve (relative to base, or absolute)
+    :retrn: malloc'd absolute path without . or .. components or trailing /
+    */
+    size_t baseLen = path[0] == '/' ? 0 : strlen(base);
+    char *out = malloc(baseLen + strlen(path) + 2);
+    size_t len = 0;
+    char *comp = path;
+
+    // base is already clean, only its trailing / (the root) needs dropping
+    memcpy(out, base, baseLen);
+    len = baseLen;
+    if (len > 0 && out[len - 1] == '/') {
+        len--;
+    }
+    while (*comp != '\0') {
+        size_t compLen = strcspn(comp, "/");
+        if (compLen == 2 && comp[0] == '.' && comp[1] == '.') {
+            while (len > 0 && out[len - 1] != '/') {
+                len--;
+            }
+            if (len > 0) {
+                len--;
+            }
+        } else if (compLen > 0 && !(compLen == 1 && comp[0] == '.')) {
+            out[len++] = '/';
+            memcpy(out + len, comp, compLen);
+            len += compLen;
+        }
+        comp += compLen;
+        if (*comp == '/') {
+            comp++;
+        }
+    }
+    if (len == 0) {
+        out[len++] = '/';
+    }
+    out[len] = '\0';
+    return out;
+}
+
+void clearCdpathCache(void) {
+    /*
+    Forget every CDPATH lookup (hash -r)
+    */
+    while (cdpathCache != NULL) {
+        struct cdpath_entry *next = cdpathCache->next;
+        free(cdpathCache->cdpath);
+        free(cdpathCache->name);
+        free(cdpathCache->resolved);
+        free(cdpathCache);
+        cdpathCache = next;
+    }
+}
+
+char *cdpathLookup(char *name, char *base) {
+    /*
+    Find the first CDPATH entry holding a directory called name. Hits are cached by CDPATH value and name with
+    the directory's inode, so a repeat costs one stat to confirm it is still the same directory
+    :param: cd argument (not starting with / . or ..), logical working directory
+    :retrn: malloc'd logical path, NULL when CDPATH is unset or has no match
+    */
+    char *cdpath = getenv("CDPATH");
+    struct cdpath_entry **link;
+    struct stat st;
+    char *entry;
+
+    if (cdpath == NULL || cdpath[0] == '\0') {
+        return NULL;
+    }
+    for (link = &cdpathCache; *link != NULL; link = &(*link)->next) {
+        struct cdpath_entry *hit = *link;
+        if (strcmp(hit->name, name) != 0 || strcmp(hit->cdpath, cdpath) != 0) {
+            continue;
+        }
+        if (stat(hit->resolved, &st) == 0 && st.st_dev == hit->dev && st.st_ino == hit->ino) {
+            return strdup(hit->resolved);
+        }
+        // replaced or removed since, look again
+        *link = hit->next;
+        free(hit->cdpath);
+        free(hit->name);
+        free(hit->resolved);
+        free(hit);
+        break;
+    }
+
+    // entries are separated by :, an empty one means the current directory
+    entry = cdpath;
+    while (1) {
+        size_t entryLen = strcspn(entry, ":");
+        char *joined = malloc(entryLen + strlen(name) + 3);
+        char *candidate;
+        if (entryLen == 0) {
+            strcpy(joined, ".");
+            entryLen = 1;
+        } else {
+            memcpy(joined, entry, entryLen);
+        }
+        joined[entryLen] = '/';
+        strcpy(joined + entryLen + 1, name);
+        candidate = logicalPath(base, joined);
+        free(joined);
+
+        if (stat(candidate, &st) == 0 && S_ISDIR(st.st_mode)) {
+            struct cdpath_entry *hit = malloc(sizeof(struct cdpath_entry));
+            hit->cdpath = strdup(cdpath);
+            hit->name = strdup(name);
+            hit->resolved = strdup(candidate);
+            hit->dev = st.st_dev;
+            hit->ino = st.st_ino;
+            hit->next = cdpathCache;
+            cdpathCache = hit;
+            return candidate;
+        }
+        free(candidate);
+        entry += strcspn(entry, ":");
+        if (*entry == '\0') {
+            return NULL;
+        }
+        entry++;
+    }
+}
+
+int changeDir(char *target) {
+    /*
+    Change the shell's directory and update $PWD and $OLDPWD from the logical path, so no getcwd is needed
+    :param: directory as given to cd
+    :retrn: 0, -1 after printing the error
+    */
+    char *base = currentDir();
+    char *path = NULL;
+
+    // a plain name may live under a CDPATH entry
+    if (target[0] != '/' && strcmp(target, ".") != 0 && strcmp(target, "..") != 0 && strncmp(target, "./", 2) != 0 &&
+        strncmp(target, "../", 3) != 0) {
+        path = cdpathLookup(target, base);
+    }
+    if (path == NULL) {
+        path = logicalPath(base, target);
+    }
+
+    if (chdir(path) != 0) {
+        int error = errno;
+        char buf[PATH_MAX];
+        free(path);
+        // the logical path can fail where the physical one works (.. out of a directory that was moved)
+        if (chdir(target) != 0 || getcwd(buf, sizeof(buf)) == NULL) {
+            printf("No such directory: %s\n%s\n", target, base);
+            fflush(stdout);
+            errno = error;
+            return -1;
+        }
+        path = strdup(buf);
+    }
+    setenv("OLDPWD", base, 1);
+    setenv("PWD", path, 1);
+    free(logicalPWD);
+    logicalPWD = path;
+    return 0;
+}
+
+void printDirs(void) {
+    /*
+    Print the directory stack on one line, the current directory first and the top of the stack next
+    */
+    int i;
+    printf("%s", currentDir());
+    for (i = dirCount - 1; i >= 0; i--) {
+        printf(" %s", dirStack[i]);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int exitBuiltIn(struct sh_command *newCommand) {
+    /*
+    exit [n] - leave the shell with status n, background jobs are terminated by main
+    :param: parsed command
+    :retrn: n, 0 by default, 2 when it isn't a number
+    */
+    char *end;
+    long n = 0;
+
+    if (newCommand->args[1] != NULL) {
+        n = strtol(newCommand->args[1], &end, 10);
+        if (end == newCommand->args[1] || *end != '\0') {
+            printf("exit: %s: numeric argument required\n", newCommand->args[1]);
+            n = 2;
+        }
+    }
+    if (inCopy == 0) {
+        printf("Goodbye!\n");
+    }
+    fflush(stdout);
+    to_exit = 1;
+    return n & 0xff;
+}
+
+int cdBuiltIn(struct sh_command *newCommand) {
+    /*
+    cd [directory | -] - change directory (no directory goes to HOME, - to OLDPWD), then print the new working
+    directory. Names not starting with / . or .. are looked up in CDPATH first
+    :param: parsed command
+    :retrn: 0 on success, 1 on error
+    */
+    char *ptr = newCommand->args[1];
+
+    // change to home directory
+    if (ptr == NULL) {
+        ptr = getenv("HOME");
+        if (ptr == NULL || ptr[0] == '\0') {
+            printf("Error finding home.\n");
+            fflush(stdout);
+            return 1;
+        }
+    // back to the previous directory
+    } else if (strcmp(ptr, "-") == 0) {
+        ptr = getenv("OLDPWD");
+        if (ptr == NULL) {
+            printf("cd: OLDPWD not set\n");
+            fflush(stdout);
+            return 1;
+        }
+    }
+    if (changeDir(ptr) == -1) {
+        return 1;
+    }
+    printf("%s\n", logicalPWD);
+    fflush(stdout);
+    return 0;
+}
+
+int pushdBuiltIn(struct sh_command *newCommand) {
+    /*
+    pushd [directory] - cd to the directory, saving the current one on the stack. No directory swaps the current
+    directory with the top of the stack. Prints the stack
+    :param: parsed command
+    :retrn: 0, 1 on error
+    */
+    char *previous = strdup(currentDir());
+    char *target = newCommand->args[1];
+
+    if (target == NULL) {
+        if (dirCount == 0) {
+            printf("pushd: no other directory\n");
+            fflush(stdout);
+            free(previous);
+            return 1;
+        }
+        target = dirStack[dirCount - 1];
+    }
+    if (changeDir(target) == -1) {
+        free(previous);
+        return 1;
+    }
+    if (newCommand->args[1] == NULL) {
+        free(dirStack[dirCount - 1]);
+        dirStack[dirCount - 1] = previous;
+    } else {
+        if (dirCount == dirCap) {
+            dirCap = dirCap == 0 ? 8 : dirCap * 2;
+            dirStack = realloc(dirStack, dirCap * sizeof(char *));
+        }
+        dirStack[dirCount++] = previous;
+    }
+    printDirs();
+    return 0;
+}
+
+int popdBuiltIn(struct sh_command *newCommand) {
+    /*
+    popd - cd to the directory on top of the stack and remove it. Prints the stack
+    :param: parsed command
+    :retrn: 0, 1 when the stack is empty or the directory is gone
+    */
+    if (dirCount == 0) {
+        printf("popd: directory stack empty\n");
+        fflush(stdout);
+        return 1;
+    }
+    if (changeDir(dirStack[dirCount - 1]) == -1) {
+        return 1;
+    }
+    free(dirStack[--dirCount]);
+    printDirs();
+    return 0;
+}
+
+int dirsBuiltIn(struct sh_command *newCommand) {
+    /*
+    dirs [-c] - print the directory stack, current directory first, -c empties it
+    :param: parsed command
+    :retrn: 0
+    */
+    if (newCommand->args[1] != NULL && strcmp(newCommand->args[1], "-c") == 0) {
+        while (dirCount > 0) {
+            free(dirStack[--dirCount]);
+        }
+        return 0;
+    }
+    printDirs();
+    return 0;
+}
+
+int statusBuiltIn(struct sh_command *newCommand) {
+    /*
+    status - print exit status of last exited program, and whether it was cut off by a deadline
+    :param: parsed command
+    :retrn: 0
+    */
+    printf("Exited with value %i%s\n", statusVar,
+           statusTimedOut == 1 && statusVar == TIMEOUT_STATUS ? " (timed out)" : "");
+    fflush(stdout);
+    return 0;
+}
+
+int hashBuiltIn(struct sh_command *newCommand) {
+    /*
+    hash [-r] - list cached command paths with hit/miss counts, -r empties the cache (and the CDPATH one)
+    :param: parsed command
+    :retrn: 0
+    */
+    char *ptr = newCommand->args[1];
+
+    // -r forgets all cached paths and resets the counters
+    if (ptr != NULL && strcmp(ptr, "-r") == 0) {
+        clearPathTable();
+        clearCdpathCache();
+        hashHits = 0;
+        hashMisses = 0;
+    } else {
+        printPathTable();
+    }
+    return 0;
+}
+
+int jobsBuiltIn(struct sh_command *newCommand) {
+    /*
+    jobs - list the job table with each job's rusage
+    :param: parsed command
+    :retrn: 0
+    */
+    printJobs();
+    return 0;
+}
+
+int waitCommand(struct sh_command *newCommand) {
+    /*
+    wait [%n] - wait for one job, or every background job
+    :param: parsed command
+    :retrn: the job's status, 0 after waiting for every job, 1 when there is no such job
+    */
+    waitBuiltIn(newCommand->args[1]);
+    return statusVar;
+}
+
+int fgBuiltIn(struct sh_command *newCommand) {
+    /*
+    fg [%n] - resume a job in the foreground
+    :param: parsed command
+    :retrn: the job's status, 1 when there is no such job
+    */
+    statusVar = 0;
+    continueJob(newCommand->args[1], 1);
+    return statusVar;
+}
+
+int bgBuiltIn(struct sh_command *newCommand) {
+    /*
+    bg [%n] - resume a stopped job in the background
+    :param: parsed command
+    :retrn: 0, 1 when there is no such job or it could not start
+    */
+    statusVar = 0;
+    continueJob(newCommand->args[1], 0);
+    return statusVar;
+}
+
+int maxjobsBuiltIn(struct sh_command *newCommand) {
+    /*
+    maxjobs [N] - run at most N & jobs at once and queue the rest, 0 lifts the limit. No argument prints it
+    :param: parsed command
+    :retrn: 0, 1 on a bad count
+    */
+    char *end;
+    long n;
+
+    if (newCommand->argc == 1) {
+        printf("maxjobs %d (%d running, %d queued)\n", maxJobs, runningJobs(), queuedJobs);
+        fflush(stdout);
+        return 0;
+    }
+    n = strtol(newCommand->args[1], &end, 10);
+    if (end == newCommand->args[1] || *end != '\0' || n < 0 || n > INT_MAX) {
+        printf("maxjobs: bad count %s\n", newCommand->args[1]);
+        fflush(stdout);
+        return 1;
+    }
+    maxJobs = n;
+    // a higher limit lets waiting jobs in now
+    startQueue();
+    return 0;
+}
+
+int queueBuiltIn(struct sh_command *newCommand) {
+    /*
+    queue [-c|-s] [%n] - list the queued & jobs with how long each has waited, -c cancels them and -s starts them
+    now regardless of maxjobs, either all of them or the one given
+    :param: parsed command
+    :retrn: 0, 1 when the job given is not queued
+    */
+    char *option = newCommand->argc > 1 && newCommand->args[1][0] == '-' ? newCommand->args[1] : NULL;
+    char *spec = newCommand->args[option != NULL ? 2 : 1];
+    struct sh_job *job = jobList;
+    struct sh_job *only = NULL;
+    struct timespec now;
+    double waited;
+
+    if (option != NULL && strcmp(option, "-c") != 0 && strcmp(option, "-s") != 0) {
+        printf("queue: bad option %s\n", option);
+        fflush(stdout);
+        return 1;
+    }
+    if (spec != NULL) {
+        only = findJob(spec);
+        if (only == NULL || only->state != JOB_QUEUED) {
+            printf("queue: %s is not queued\n", spec);
+            fflush(stdout);
+            return 1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (job != NULL) {
+        struct sh_job *next = job->next;
+        if (job->state == JOB_QUEUED && (only == NULL || job == only)) {
+            elapsedSince(&job->submitted, &now, &waited);
+            if (option == NULL) {
+                printf("[%d] waiting %.3fs  %s\n", job->id, waited, job->text);
+            } else if (option[1] == 'c') {
+                printf("[%d] cancelled after %.3fs  %s\n", job->id, waited, job->text);
+                freeJob(job);
+            } else {
+                startQueued(job);
+            }
+        }
+        job = next;
+    }
+    fflush(stdout);
+    return 0;
+}
+
+int deadlineBuiltIn(struct sh_command *newCommand) {
+    /*
+    deadline [DURATION | off] - give every job started from now on DURATION (s/m/h/d suffix, seconds by default)
+    before it is sent SIGTERM, unless a timeout prefix says otherwise. No argument prints the setting
+    :param: parsed command
+    :retrn: 0, 1 on a bad duration
+    */
+    double limit;
+
+    if (newCommand->argc == 1) {
+        if (defaultDeadline > 0) {
+            printf("deadline %gs\n", defaultDeadline);
+        } else {
+            printf("deadline off\n");
+        }
+        fflush(stdout);
+        return 0;
+    }
+    limit = strcmp(newCommand->args[1], "off") == 0 ? 0 : parseDuration(newCommand->args[1]);
+    if (newCommand->argc > 2 || limit == -1) {
+        printf("deadline: usage: deadline [DURATION | off]\n");
+        fflush(stdout);
+        return 1;
+    }
+    defaultDeadline = limit;
+    return 0;
+}
+
+int bgoutputBuiltIn(struct sh_command *newCommand) {
+    /*
+    bgoutput [discard | capture [SIZE] | spill DIR [SIZE]] - what happens to the output of & jobs without a
+    redirection. capture keeps the last SIZE bytes (K/M suffix, 64K by default) of each job's stdout and stderr
+    for the output builtin, spill also saves them to DIR when the job ends. No argument prints the setting
+    :param: parsed command
+    :retrn: 0, 1 on a bad setting
+    */
+    char *mode = newCommand->args[1];
+    char *size = NULL;
+    char *dir = NULL;
+    size_t bytes = ringSize;
+    struct stat st;
+
+    if (mode == NULL) {
+        if (bgOutput == BGOUT_DISCARD) {
+            printf("bgoutput discard\n");
+        } else if (bgOutput == BGOUT_CAPTURE) {
+            printf("bgoutput capture %zu\n", ringSize);
+        } else {
+            printf("bgoutput spill %s %zu\n", spillDir, ringSize);
+        }
+        fflush(stdout);
+        return 0;
+    }
+    if (strcmp(mode, "discard") == 0 && newCommand->argc == 2) {
+        bgOutput = BGOUT_DISCARD;
+        return 0;
+    }
+    if (strcmp(mode, "capture") == 0 && newCommand->argc <= 3) {
+        size = newCommand->args[2];
+    } else if (strcmp(mode, "spill") == 0 && newCommand->argc >= 3 && newCommand->argc <= 4) {
+        dir = newCommand->args[2];
+        size = newCommand->args[3];
+        if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+            printf("bgoutput: %s is not a directory\n", dir);
+            fflush(stdout);
+            return 1;
+        }
+    } else {
+        printf("bgoutput: usage: bgoutput [discard | capture [SIZE] | spill DIR [SIZE]]\n");
+        fflush(stdout);
+        return 1;
+    }
+    if (size != NULL) {
+        char *end;
+        bytes = strtoul(size, &end, 10);
+        if (*end == 'K' || *end == 'k') {
+            bytes <<= 10;
+            end++;
+        } else if (*end == 'M' || *end == 'm') {
+            bytes <<= 20;
+            end++;
+        }
+        if (end == size || *end != '\0' || size[0] == '-' || bytes == 0) {
+            printf("bgoutput: bad size %s\n", size);
+            fflush(stdout);
+            return 1;
+        }
+    }
+
+    // jobs already running keep the ring size they started with
+    ringSize = bytes;
+    if (dir != NULL) {
+        free(spillDir);
+        spillDir = strdup(dir);
+        bgOutput = BGOUT_SPILL;
+    } else {
+        bgOutput = BGOUT_CAPTURE;
+    }
+    return 0;
+}
+
+struct sh_ring *findOutput(char *spec, int *id) {
+    /*
+    Find captured output by job spec, or the newest job with any - in the job table first, then among the output
+    kept from jobs that have left it
+    :param: job spec (%n or process group number), NULL for the newest; where to store the job number
+    :retrn: ring, NULL if there is none
+    */
+    struct sh_job *job = NULL;
+    struct sh_job *scan;
+    struct sh_output *kept;
+    struct sh_ring *found = NULL;
+    int byID = 0;
+    long n = 0;
+
+    if (spec != NULL) {
+        job = findJob(spec);
+    } else {
+        for (scan = jobList; scan != NULL; scan = scan->next) {
+            if (scan->output.size > 0 && (scan->output.data != NULL || scan->state != JOB_DONE)) {
+                job = scan;
+            }
+        }
+    }
+    // a finished job's output has already moved to the kept list
+    if (job != NULL && job->output.size > 0 && (job->output.data != NULL || job->state != JOB_DONE)) {
+        // pick up anything written since the event loop last ran
+        if (job->outFD > 0) {
+            drainOutput(job);
+        }
+        *id = job->id;
+        return &job->output;
+    }
+
+    if (spec != NULL) {
+        char *end;
+        byID = spec[0] == '%';
+        n = strtol(byID ? spec + 1 : spec, &end, 10);
+        if (*end != '\0') {
+            return NULL;
+        }
+    }
+    // job numbers are reused, the newest match wins
+    for (kept = keptOutput; kept != NULL; kept = kept->next) {
+        if (spec == NULL || (byID && kept->id == n) || (!byID && kept->pgid == n)) {
+            found = &kept->ring;
+            *id = kept->id;
+        }
+    }
+    return found;
+}
+
+int outputBuiltIn(struct sh_command *newCommand) {
+    /*
+    output [%n] [FILE] - print the captured output of a job (the newest one with any by default), or save it to FILE.
+    Output stays available after the job has left the job table
+    :param: parsed command
+    :retrn: 0, 1 when there is no such output or FILE can't be written
+    */
+    // a job is given as %n or by its process group number
+    char *arg = newCommand->args[1];
+    char *spec = arg != NULL && (arg[0] == '%' || (arg[0] != '\0' && arg[strspn(arg, "0123456789")] == '\0'))
+                     ? arg : NULL;
+    char *file = newCommand->args[spec != NULL ? 2 : 1];
+    struct sh_ring *ring;
+    int id = 0;
+    int fd = STDOUT_FILENO;
+    int result = 0;
+
+    ring = findOutput(spec, &id);
+    if (ring == NULL) {
+        printf("output: no captured output%s%s\n", spec != NULL ? " for " : "", spec != NULL ? spec : "");
+        fflush(stdout);
+        return 1;
+    }
+
+    if (file != NULL) {
+        fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            printf("output: cannot open %s: %s\n", file, strerror(errno));
+            fflush(stdout);
+            return 1;
+        }
+    }
+    if (ring->dropped > 0) {
+        printf("output: [%d] first %zu bytes were dropped\n", id, ring->dropped);
+    }
+    fflush(stdout);
+    if (ringSave(ring, fd) == -1) {
+        printf("output: %s\n", strerror(errno));
+        fflush(stdout);
+        result = 1;
+    } else {
+        // read output of finished jobs can make way now
+        ring->unread = 0;
+        trimOutput();
+    }
+    if (fd != STDOUT_FILENO) {
+        close(fd);
+    }
+    return result;
+}
+
+int printEscape(char *text, int *used) {
+    /*
+    Decode one backslash escape for printf and echo -e: \n \t \\ \a \b \f \r \v and \NNN octal
+    :param: text just after the backslash, where to store how many characters it took
+    :retrn: the character
+    */
+    int value = 0;
+    int digits = 0;
+
+    *used = 1;
+    switch (text[0]) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case '\\': return '\\';
+        case 'a': return '\a';
+        case 'b': return '\b';
+        case 'f': return '\f';
+        case 'r': return '\r';
+        case 'v': return '\v';
+        case '\0':
+            *used = 0;
+            return '\\';
+    }
+    // up to three octal digits, \0NNN as well for %b
+    if (text[0] == '0') {
+        digits++;
+    }
+    while (digits < 4 && text[digits] >= '0' && text[digits] <= '7') {
+        value = value * 8 + (text[digits] - '0');
+        digits++;
+        if (digits == 3 && text[0] != '0') {
+            break;
+        }
+    }
+    if (digits == 0) {
+        // unknown escape stays as written
+        *used = 0;
+        return '\\';
+    }
+    *used = digits;
+    return value & 0xff;
+}
+
+int echoBuiltIn(struct sh_command *newCommand) {
+    /*
+    echo [-neE] [word ...] - print the words separated by blanks, -n leaves off the newline, -e decodes backslash
+    escapes (\c stops the output), -E leaves them as written
+    :param: parsed command
+    :retrn: 0
+    */
+    int newline = 1;
+    int escapes = 0;
+    int i = 1;
+    int used;
+    char *c;
+
+    // any number of leading flag words, as long as every letter in them is one of n, e and E
+    while (newCommand->args[i] != NULL && newCommand->args[i][0] == '-' && newCommand->args[i][1] != '\0' &&
+           newCommand->args[i][strspn(newCommand->args[i] + 1, "neE") + 1] == '\0') {
+        for (c = newCommand->args[i] + 1; *c != '\0'; c++) {
+            if (*c == 'n') {
+                newline = 0;
+            } else {
+                escapes = *c == 'e';
+            }
+        }
+        i++;
+    }
+    for (; newCommand->args[i] != NULL; i++) {
+        if (escapes == 0) {
+            fputs(newCommand->args[i], stdout);
+        } else {
+            for (c = newCommand->args[i]; *c != '\0'; c++) {
+                if (*c != '\\') {
+                    putchar(*c);
+                } else if (c[1] == 'c') {
+                    fflush(stdout);
+                    return 0;
+                } else {
+                    putchar(printEscape(c + 1, &used));
+                    c += used;
+                }
+            }
+        }
+        if (newCommand->args[i + 1] != NULL) {
+            putchar(' ');
+        }
+    }
+    if (newline == 1) {
+        putchar('\n');
+    }
+    fflush(stdout);
+    return 0;
+}
+
+int pwdBuiltIn(struct sh_command *newCommand) {
+    /*
+    pwd - print the current working directory
+    :param: parsed command
+    :retrn: 0
+    */
+    // the logical directory cd keeps, as sh's pwd -L
+    printf("%s\n", currentDir());
+    fflush(stdout);
+    return 0;
+}
+
+int trueBuiltIn(struct sh_command *newCommand) {
+    /*
+    true - do nothing, successfully
+    :param: parsed command
+    :retrn: 0
+    */
+    return 0;
+}
+
+int falseBuiltIn(struct sh_command *newCommand) {
+    /*
+    false - do nothing, unsuccessfully
+    :param: parsed command
+    :retrn: 1
+    */
+    return 1;
+}
+
+int testInteger(char *word, long long *value) {
+    /*
+    Read a whole word as a decimal integer for the test comparisons
+    :param: word, where to store the number
+    :retrn: 0 on success, -1 (after printing the error) when it isn't one
+    */
+    char *end;
+
+    errno = 0;
+    *value = strtoll(word, &end, 10);
+    if (end == word || *end != '\0' || errno != 0) {
+        fprintf(stderr, "test: %s: integer expression expected\n", word);
+        return -1;
+    }
+    return 0;
+}
+
+int testUnary(char *op, char *operand) {
+    /*
+    Evaluate a unary test primary, string checks and file checks through one stat
+    :param: operator like -f, operand
+    :retrn: 0 true, 1 false, 2 unknown operator
+    */
+    struct stat info;
+
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') {
+        return 2;
+    }
+    switch (op[1]) {
+        case 'n':
+            return operand[0] != '\0' ? 0 : 1;
+        case 'z':
+            return operand[0] == '\0' ? 0 : 1;
+        case 't':
+            return isatty(atoi(operand)) ? 0 : 1;
+        case 'r':
+            return access(operand, R_OK) == 0 ? 0 : 1;
+        case 'w':
+            return access(operand, W_OK) == 0 ? 0 : 1;
+        case 'x':
+            return access(operand, X_OK) == 0 ? 0 : 1;
+        case 'h':
+        case 'L':
+            return lstat(operand, &info) == 0 && S_ISLNK(info.st_mode) ? 0 : 1;
+        case 'e': case 'f': case 'd': case 's': case 'b': case 'c': case 'p': case 'S': case 'u': case 'g':
+            break;
+        default:
+            return 2;
+    }
+
+    // the rest all need the file's metadata
+    if (stat(operand, &info) != 0) {
+        return 1;
+    }
+    switch (op[1]) {
+        case 'f':
+            return S_ISREG(info.st_mode) ? 0 : 1;
+        case 'd':
+            return S_ISDIR(info.st_mode) ? 0 : 1;
+        case 's':
+            return info.st_size > 0 ? 0 : 1;
+        case 'b':
+            return S_ISBLK(info.st_mode) ? 0 : 1;
+        case 'c':
+            return S_ISCHR(info.st_mode) ? 0 : 1;
+        case 'p':
+            return S_ISFIFO(info.st_mode) ? 0 : 1;
+        case 'S':
+            return S_ISSOCK(info.st_mode) ? 0 : 1;
+        case 'u':
+            return (info.st_mode & S_ISUID) ? 0 : 1;
+        case 'g':
+            return (info.st_mode & S_ISGID) ? 0 : 1;
+    }
+    // -e
+    return 0;
+}
+
+int testBinary(char *left, char *op, char *right) {
+    /*
+    Evaluate a binary test primary, string equality or integer comparison
+    :param: left operand, operator, right operand
+    :retrn: 0 true, 1 false, 2 error, 3 not a binary operator
+    */
+    long long a;
+    long long b;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(left, right) == 0 ? 0 : 1;
+    }
+    if (strcmp(op, "!=") == 0) {
+        return strcmp(left, right) != 0 ? 0 : 1;
+    }
+    if (strcmp(op, "-eq") != 0 && strcmp(op, "-ne") != 0 && strcmp(op, "-lt") != 0 &&
+            strcmp(op, "-le") != 0 && strcmp(op, "-gt") != 0 && strcmp(op, "-ge") != 0) {
+        return 3;
+    }
+    if (testInteger(left, &a) == -1 || testInteger(right, &b) == -1) {
+        return 2;
+    }
+    switch (op[1] * 256 + op[2]) {
+        case 'e' * 256 + 'q': return a == b ? 0 : 1;
+        case 'n' * 256 + 'e': return a != b ? 0 : 1;
+        case 'l' * 256 + 't': return a < b ? 0 : 1;
+        case 'l' * 256 + 'e': return a <= b ? 0 : 1;
+        case 'g' * 256 + 't': return a > b ? 0 : 1;
+    }
+    return a >= b ? 0 : 1;
+}
+
+int testOr(char **args, int count, int *pos);
+
+int testPrimary(char **args, int count, int *pos) {
+    /*
+    Evaluate one operand of -a/-o: a ! negation, a ( ) group, a binary or unary primary, or a lone string
+    :param: arguments, how many, index of the next one (advanced past what was used)
+    :retrn: 0 true, 1 false, 2 error
+    */
+    char **at = args + *pos;
+    int left = count - *pos;
+    int result;
+
+    if (left <= 0) {
+        fprintf(stderr, "test: argument expected\n");
+        return 2;
+    }
+    if (strcmp(at[0], "!") == 0 && left > 1) {
+        (*pos)++;
+        result = testPrimary(args, count, pos);
+        return result == 2 ? 2 : !result;
+    }
+    if (strcmp(at[0], "(") == 0 && left > 1) {
+        (*pos)++;
+        result = testOr(args, count, pos);
+        if (result != 2 && (*pos >= count || strcmp(args[*pos], ")") != 0)) {
+            fprintf(stderr, "test: `)' expected\n");
+            return 2;
+        }
+        (*pos)++;
+        return result;
+    }
+    if (left >= 3) {
+        result = testBinary(at[0], at[1], at[2]);
+        if (result != 3) {
+            *pos += 3;
+            return result;
+        }
+    }
+    if (left >= 2) {
+        result = testUnary(at[0], at[1]);
+        if (result != 2) {
+            *pos += 2;
+            return result;
+        }
+    }
+    (*pos)++;
+    return at[0][0] != '\0' ? 0 : 1;
+}
+
+int testAnd(char **args, int count, int *pos) {
+    /*
+    Evaluate primaries joined by -a, which binds tighter than -o
+    :param: arguments, how many, index of the next one
+    :retrn: 0 true, 1 false, 2 error
+    */
+    int result = testPrimary(args, count, pos);
+
+    while (result != 2 && *pos < count && strcmp(args[*pos], "-a") == 0) {
+        int right;
+        (*pos)++;
+        right = testPrimary(args, count, pos);
+        result = right == 2 ? 2 : (result == 0 && right == 0 ? 0 : 1);
+    }
+    return result;
+}
+
+int testOr(char **args, int count, int *pos) {
+    /*
+    Evaluate -a groups joined by -o
+    :param: arguments, how many, index of the next one
+    :retrn: 0 true, 1 false, 2 error
+    */
+    int result = testAnd(args, count, pos);
+
+    while (result != 2 && *pos < count && strcmp(args[*pos], "-o") == 0) {
+        int right;
+        (*pos)++;
+        right = testAnd(args, count, pos);
+        result = right == 2 ? 2 : (result == 0 || right == 0 ? 0 : 1);
+    }
+    return result;
+}
+
+int testExpression(char **args, int count) {
+    /*
+    Evaluate test arguments by count, the POSIX rules for up to four arguments, and -a/-o (with ! and ( ) inside)
+    past that
+    :param: arguments after the command name (and without a closing ]), how many
+    :retrn: 0 true, 1 false, 2 error
+    */
+    int result;
+    int pos = 0;
+
+    switch (count) {
+        case 0:
+            return 1;
+        case 1:
+            return args[0][0] != '\0' ? 0 : 1;
+        case 2:
+            if (strcmp(args[0], "!") == 0) {
+                return args[1][0] != '\0' ? 1 : 0;
+            }
+            result = testUnary(args[0], args[1]);
+            if (result == 2) {
+                fprintf(stderr, "test: %s: unary operator expected\n", args[0]);
+            }
+            return result;
+        case 3:
+            result = testBinary(args[0], args[1], args[2]);
+            if (result != 3) {
+                return result;
+            }
+            if (strcmp(args[1], "-a") == 0 || strcmp(args[1], "-o") == 0) {
+                break;
+            }
+            if (strcmp(args[0], "!") == 0) {
+                result = testExpression(args + 1, 2);
+                return result == 2 ? 2 : !result;
+            }
+            if (strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0) {
+                return testExpression(args + 1, 1);
+            }
+            fprintf(stderr, "test: %s: binary operator expected\n", args[1]);
+            return 2;
+        case 4:
+            if (strcmp(args[0], "!") == 0) {
+                result = testExpression(args + 1, 3);
+                return result == 2 ? 2 : !result;
+            }
+            if (strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0) {
+                return testExpression(args + 1, 2);
+            }
+            break;
+    }
+    result = testOr(args, count, &pos);
+    if (result != 2 && pos < count) {
+        fprintf(stderr, "test: too many arguments\n");
+        return 2;
+    }
+    return result;
+}
+
+int testBuiltIn(struct sh_command *newCommand) {
+    /*
+    test expr / [ expr ] - evaluate a conditional expression: -e -f -d -r -w -x -s -L and friends on files,
+    -n -z = != on strings, -eq -ne -lt -le -gt -ge on integers, ! -a -o and ( ) to combine them
+    :param: parsed command
+    :retrn: 0 true, 1 false, 2 error
+    */
+    int count = newCommand->argc - 1;
+
+    // [ needs its closing bracket, which is not part of the expression
+    if (strcmp(newCommand->args[0], "[") == 0) {
+        if (count == 0 || strcmp(newCommand->args[count], "]") != 0) {
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        count--;
+    }
+    return testExpression(newCommand->args + 1, count);
+}
+
+int printfBuiltIn(struct sh_command *newCommand) {
+    /*
+    printf format [argument ...] - write arguments under control of the format, reusing the format until
+    every argument is consumed. Handles %d %i %u %o %x %X %c %s %b %e %f %g with flags, width and precision
+    :param: parsed command
+    :retrn: 0, or 1 when an argument wasn't a valid number
+    */
+    char *format = newCommand->args[1];
+    char **args = newCommand->args + 2;
+    char spec[64];
+    int result = 0;
+    int used;
+
+    if (format == NULL) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    do {
+        char **start = args;
+        char *f;
+        for (f = format; *f != '\0'; f++) {
+            // plain text and escapes
+            if (*f == '\\') {
+                putchar(printEscape(f + 1, &used));
+                f += used;
+                continue;
+            }
+            if (*f != '%') {
+                putchar(*f);
+                continue;
+            }
+            if (f[1] == '%') {
+                putchar('%');
+                f++;
+                continue;
+            }
+
+            // copy the conversion, flags through precision, leaving room for a length modifier
+            size_t n = 0;
+            spec[n++] = *f++;
+            while (*f != '\0' && strchr("-+ #0123456789.", *f) != NULL && n < sizeof(spec) - 4) {
+                spec[n++] = *f++;
+            }
+            if (*f == '\0') {
+                fprintf(stderr, "printf: %s: invalid conversion\n", spec);
+                fflush(stdout);
+                return 1;
+            }
+            char *arg = *args != NULL ? *args++ : NULL;
+            char *end;
+
+            switch (*f) {
+                case 'd': case 'i': {
+                    long long value = 0;
+                    if (arg != NULL && (arg[0] == '\'' || arg[0] == '"')) {
+                        // 'c gives the character's value
+                        value = (unsigned char)arg[1];
+                    } else if (arg != NULL) {
+                        errno = 0;
+                        value = strtoll(arg, &end, 0);
+                        if (end == arg || *end != '\0' || errno != 0) {
+                            fprintf(stderr, "printf: %s: invalid number\n", arg);
+                            result = 1;
+                        }
+                    }
+                    spec[n++] = 'l';
+                    spec[n++] = 'l';
+                    spec[n++] = *f;
+                    spec[n] = '\0';
+                    printf(spec, value);
+                    break;
+                }
+                case 'u': case 'o': case 'x': case 'X': {
+                    unsigned long long value = 0;
+                    if (arg != NULL && (arg[0] == '\'' || arg[0] == '"')) {
+                        value = (unsigned char)arg[1];
+                    } else if (arg != NULL) {
+                        errno = 0;
+                        value = strtoull(arg, &end, 0);
+                        if (end == arg || *end != '\0' || errno != 0) {
+                            fprintf(stderr, "printf: %s: invalid number\n", arg);
+                            result = 1;
+                        }
+                    }
+                    spec[n++] = 'l';
+                    spec[n++] = 'l';
+                    spec[n++] = *f;
+                    spec[n] = '\0';
+                    printf(spec, value);
+                    break;
+                }
+                case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': {
+                    double value = 0;
+                    if (arg != NULL) {
+                        value = strtod(arg, &end);
+                        if (end == arg || *end != '\0') {
+                            fprintf(stderr, "printf: %s: invalid number\n", arg);
+                            result = 1;
+                        }
+                    }
+                    spec[n++] = *f;
+                    spec[n] = '\0';
+                    printf(spec, value);
+                    break;
+                }
+                case 'c':
+                    spec[n++] = 'c';
+                    spec[n] = '\0';
+                    printf(spec, arg != NULL && arg[0] != '\0' ? arg[0] : '\0');
+                    break;
+                case 's':
+                    spec[n++] = 's';
+                    spec[n] = '\0';
+                    printf(spec, arg != NULL ? arg : "");
+                    break;
+                case 'b':
+                    // the argument's own escapes are expanded, precision and width are not supported here
+                    for (; arg != NULL && *arg != '\0'; arg++) {
+                        if (*arg == '\\') {
+                            putchar(printEscape(arg + 1, &used));
+                            arg += used;
+                        } else {
+                            putchar(*arg);
+                        }
+                    }
+                    break;
+                default:
+                    spec[n++] = *f;
+                    spec[n] = '\0';
+                    fprintf(stderr, "printf: %s: invalid conversion\n", spec);
+                    fflush(stdout);
+                    return 1;
+            }
+        }
+        // a format that takes no arguments is only written once
+        if (args == start) {
+            break;
+        }
+    } while (*args != NULL);
+
+    fflush(stdout);
+    return result;
+}
+
+int statsBuiltIn(struct sh_command *newCommand) {
+    /*
+    stats [-r] - print p50/p90/p99 latency of each phase --trace has recorded, -r starts the counts over
+    :param: parsed command
+    :retrn: 0, or 1 when tracing is off
+    */
+    char p50[16], p90[16], p99[16], max[16];
+    int i;
+
+    if (traceFile == NULL) {
+        printf("stats: tracing is off, start the shell with --trace\n");
+        fflush(stdout);
+        return 1;
+    }
+    if (newCommand->args[1] != NULL && strcmp(newCommand->args[1], "-r") == 0) {
+        memset(phaseHist, 0, sizeof(phaseHist));
+        return 0;
+    }
+
+    printf("%-9s %8s %9s %9s %9s %9s\n", "phase", "count", "p50", "p90", "p99", "max");
+    for (i = 0; i < TRACE_PHASES; i++) {
+        struct histogram *h = &phaseHist[i];
+        if (h->count == 0) {
+            printf("%-9s %8d %9s %9s %9s %9s\n", phaseNames[i], 0, "-", "-", "-", "-");
+            continue;
+        }
+        formatNanos(p50, sizeof(p50), histPercentile(h, 50));
+        formatNanos(p90, sizeof(p90), histPercentile(h, 90));
+        formatNanos(p99, sizeof(p99), histPercentile(h, 99));
+        formatNanos(max, sizeof(max), h->max);
+        printf("%-9s %8ld %9s %9s %9s %9s\n", phaseNames[i], h->count, p50, p90, p99, max);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+int loopLevels(struct sh_command *newCommand, char *name) {
+    /*
+    Number of loops break/continue leave, capped at the loops running
+    :param: parsed command, builtin name for errors
+    :retrn: levels, 0 after printing why there is nothing to leave
+    */
+    int levels = newCommand->args[1] != NULL ? atoi(newCommand->args[1]) : 1;
+    if (loopDepth == 0) {
+        printf("%s: only meaningful in a loop\n", name);
+        fflush(stdout);
+        return 0;
+    }
+    if (levels < 1) {
+        printf("%s: %s: loop count out of range\n", name, newCommand->args[1]);
+        fflush(stdout);
+        return 0;
+    }
+    return levels > loopDepth ? loopDepth : levels;
+}
+
+int breakBuiltIn(struct sh_command *newCommand) {
+    /*
+    break [n] - leave the innermost n loops
+    :param: parsed command
+    :retrn: 0, 1 outside a loop
+    */
+    breakLevels = loopLevels(newCommand, "break");
+    return breakLevels == 0;
+}
+
+int continueBuiltIn(struct sh_command *newCommand) {
+    /*
+    continue [n] - start the next pass of the nth enclosing loop
+    :param: parsed command
+    :retrn: 0, 1 outside a loop
+    */
+    continueLevels = loopLevels(newCommand, "continue");
+    return continueLevels == 0;
+}
+
+int returnBuiltIn(struct sh_command *newCommand) {
+    /*
+    return [n] - leave the running function with status n (default: the last status)
+    :param: parsed command
+    :retrn: status to return, 1 outside a function
+    */
+    if (funcDepth == 0) {
+        printf("return: can only return from a function\n");
+        fflush(stdout);
+        return 1;
+    }
+    returning = 1;
+    return newCommand->args[1] != NULL ? atoi(newCommand->args[1]) & 0xff : statusVar;
+}
+
+int bgplaceBuiltIn(struct sh_command *newCommand) {
+    /*
+    bgplace [-r] [cpus LIST] [nice N] [ioprio CLASS[:LEVEL]] [limit RESOURCE=VALUE]... [spread|nospread] - set the
+    placement every & job gets, spread pins successive jobs to the next CPU in turn. No arguments prints it
+    :param: parsed command
+    :retrn: 0, 1 on a bad setting (nothing is changed)
+    */
+    struct sh_placement next = bgPlace;
+    int spread = spreadJobs;
+    char cpus[256];
+    int i;
+
+    if (newCommand->argc == 1) {
+        printf("bgplace");
+        if (bgPlace.hasCpus == 1) {
+            formatCpuList(&bgPlace.cpus, cpus, sizeof(cpus));
+            printf(" cpus %s", cpus);
+        }
+        if (bgPlace.hasNice == 1) {
+            printf(" nice %d", bgPlace.nice);
+        }
+        if (bgPlace.ioprio != 0) {
+            int class = bgPlace.ioprio >> IOPRIO_CLASS_SHIFT;
+            if (class == IOPRIO_CLASS_IDLE) {
+                printf(" ioprio idle");
+            } else {
+                printf(" ioprio %s:%d", class == IOPRIO_CLASS_RT ? "rt" : "be", bgPlace.ioprio & 7);
+            }
+        }
+        for (i = 0; i < bgPlace.limitCount; i++) {
+            int r;
+            for (r = 0; limitNames[r].resource != bgPlace.limitResource[i]; r++);
+            if (bgPlace.limitValue[i] == RLIM_INFINITY) {
+                printf(" limit %s=unlimited", limitNames[r].name);
+            } else {
+                printf(" limit %s=%llu", limitNames[r].name, (unsigned long long)bgPlace.limitValue[i]);
+            }
+        }
+        printf("%s\n", spreadJobs == 1 ? " spread" : "");
+        fflush(stdout);
+        return 0;
+    }
+
+    for (i = 1; i < newCommand->argc; i++) {
+        char *word = newCommand->args[i];
+        if (strcmp(word, "-r") == 0) {
+            memset(&next, 0, sizeof(next));
+            spread = 0;
+        } else if (strcmp(word, "spread") == 0) {
+            spread = 1;
+        } else if (strcmp(word, "nospread") == 0) {
+            spread = 0;
+        } else if (i + 1 < newCommand->argc && placeOption(&next, word, newCommand->args[i + 1]) == 1) {
+            i++;
+        } else {
+            printf("bgplace: bad setting %s\n", word);
+            fflush(stdout);
+            return 1;
+        }
+    }
+    bgPlace = next;
+    bgPlaced = next.hasCpus || next.hasNice || next.ioprio != 0 || next.limitCount > 0;
+    spreadJobs = spread;
+    return 0;
+}
+
+// built-in commands, looked up by exact name
+struct sh_builtin {
+    char *name;
+    int (*run)(struct sh_command *);
+    // return value becomes the status - every builtin but status, which reports it
+    int setsStatus;
+    // stand-alone utility - runs in-process with its own redirections, but as an external command in a pipeline or &
+    int utility;
+};
+
+struct sh_builtin builtInTable[] = {
+    {"exit", exitBuiltIn, 1, 0},
+    {"cd", cdBuiltIn, 1, 0},
+    {"pushd", pushdBuiltIn, 1, 0},
+    {"popd", popdBuiltIn, 1, 0},
+    {"dirs", dirsBuiltIn, 1, 0},
+    {"status", statusBuiltIn, 0, 0},
+    {"hash", hashBuiltIn, 1, 0},
+    {"parallel", parallelBuiltIn, 1, 0},
+    {"jobs", jobsBuiltIn, 1, 0},
+    {"wait", waitCommand, 1, 0},
+    {"fg", fgBuiltIn, 1, 0},
+    {"bg", bgBuiltIn, 1, 0},
+    {"stats", statsBuiltIn, 1, 0},
+    {"bgplace", bgplaceBuiltIn, 1, 0},
+    {"maxjobs", maxjobsBuiltIn, 1, 0},
+    {"queue", queueBuiltIn, 1, 0},
+    {"deadline", deadlineBuiltIn, 1, 0},
+    {"bgoutput", bgoutputBuiltIn, 1, 0},
+    {"output", outputBuiltIn, 1, 0},
+    {"break", breakBuiltIn, 1, 0},
+    {"continue", continueBuiltIn, 1, 0},
+    {"return", returnBuiltIn, 1, 0},
+    {"echo", echoBuiltIn, 1, 1},
+    {"pwd", pwdBuiltIn, 1, 1},
+    {"true", trueBuiltIn, 1, 1},
+    {"false", falseBuiltIn, 1, 1},
+    {"test", testBuiltIn, 1, 1},
+    {"[", testBuiltIn, 1, 1},
+    {"printf", printfBuiltIn, 1, 1},
+    {NULL, NULL, 0, 0}
+};
+
+void restoreBuiltIn(int saved[3]) {
+    /*
+    Put back the standard descriptors redirectBuiltIn replaced
+    :param: saved copies of fds 0-2 (-1 when untouched)
+    */
+    int fd;
+    fflush(stdout);
+    for (fd = 0; fd < 3; fd++) {
+        if (saved[fd] != -1) {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+            saved[fd] = -1;
+        }
+    }
+}
+
+int redirectBuiltIn(struct sh_command *newCommand, int saved[3]) {
+    /*
+    Apply a utility's redirections to the shell's own stdin/stdout/stderr, keeping the originals to put back
+    :param: parsed command (redirections touch fds 0-2 only), saved copies of fds 0-2 (-1 when untouched)
+    :retrn: 0 on success, 1 after printing the same error a child would
+    */
+    struct sh_redirect *r;
+    int opened[MAX_REDIRECTS];
+    int nOpened = 0;
+    int i;
+
+    saved[0] = -1;
+    saved[1] = -1;
+    saved[2] = -1;
+
+    // every file is opened before anything moves, so errors reach the real stdout
+    for (r = newCommand->redirects; r != NULL; r = r->next) {
+        if (r->kind == REDIR_DUP) {
+            continue;
+        }
+        opened[nOpened] = openRedirect(r);
+        if (opened[nOpened] == -1) {
+            for (i = 0; i < nOpened; i++) {
+                close(opened[i]);
+            }
+            return 1;
+        }
+        nOpened++;
+    }
+
+    // then moved into place in the order written
+    fflush(stdout);
+    i = 0;
+    for (r = newCommand->redirects; r != NULL; r = r->next) {
+        if (saved[r->fd] == -1) {
+            saved[r->fd] = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+        }
+        if (r->kind != REDIR_DUP) {
+            dup2(opened[i], r->fd);
+            close(opened[i++]);
+        } else if (strcmp(r->target, "-") == 0) {
+            close(r->fd);
+        } else if (dup2(atoi(r->target), r->fd) == -1) {
+            while (i < nOpened) {
+                close(opened[i++]);
+            }
+            restoreBuiltIn(saved);
+            printf("%s: bad file descriptor\n", r->target);
+            fflush(stdout);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+struct sh_builtin *findBuiltIn(char *name) {
+    /*
+    Look a command name up in the built-in table
+    :param: command name
+    :retrn: table entry, NULL when the name is not a built-in
+    */
+    struct sh_builtin *entry;
+    for (entry = builtInTable; entry->name != NULL; entry++) {
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+int checkBuiltIns(struct sh_command *newCommand) {
+    /*
+    Look the first word of the command up in the built-in table and run it in the shell, with its redirections of
+    fds 0-2 applied around it. Utilities (echo, pwd, true, false, test, [, printf) leave pipelines, background
+    commands and other descriptors to the external program; the rest can't redirect those
+    :param: parsed command
+    :retrn: command recognized bool
+    */
+    struct sh_builtin *entry = findBuiltIn(newCommand->args[0]);
+    struct sh_redirect *r;
+    int saved[3];
+    int result;
+
+    if (entry == NULL) {
+        return 0;
+    }
+
+    if (entry->utility == 1) {
+        // placed commands need a process of their own
+        if (newCommand->next != NULL || newCommand->background == 1 || newCommand->external == 1) {
+            return 0;
+        }
+        // descriptors past stderr are left to the external program too
+        for (r = newCommand->redirects; r != NULL; r = r->next) {
+            if (r->fd > 2) {
+                return 0;
+            }
+        }
+    } else {
+        for (r = newCommand->redirects; r != NULL; r = r->next) {
+            if (r->fd > 2) {
+                printf("%s: cannot redirect descriptor %d of a builtin\n", newCommand->args[0], r->fd);
+                fflush(stdout);
+                statusVar = 1;
+                return 1;
+            }
+        }
+    }
+
+    if (redirectBuiltIn(newCommand, saved) == 1) {
+        statusVar = 1;
+        return 1;
+    }
+    result = entry->run(newCommand);
+    restoreBuiltIn(saved);
+
+    if (entry->setsStatus == 1) {
+        statusVar = result;
+    }
+    return 1;
+}
+
+size_t nameLength(char *text) {
+    /*
+    Length of the variable or function name the text starts with - a letter or _, then letters, digits and _
+    :param: text
+    :retrn: name length, 0 when the text does not start with a name
+    */
+    char *p = text;
+    if (!(*p == '_' || (*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z'))) {
+        return 0;
+    }
+    while (*p == '_' || (*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9')) {
+        p++;
+    }
+    return p - text;
+}
+
+char *assignment(char *word) {
+    /*
+    Find the = of a NAME=value word
+    :param: word
+    :retrn: pointer to the =, NULL when the word is not an assignment
+    */
+    size_t len = nameLength(word);
+    return len > 0 && word[len] == '=' ? word + len : NULL;
+}
+
+struct sh_function *findFunction(char *name) {
+    /*
+    Look a command name up among the defined functions
+    :param: command name
+    :retrn: function, NULL when none has that name
+    */
+    struct sh_function *f;
+    for (f = functions; f != NULL; f = f->next) {
+        if (strcmp(f->name, name) == 0) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+void defineFunction(char *name, struct sh_node *body) {
+    /*
+    Bind a compiled body to a function name, replacing an earlier definition
+    :param: function name, compiled body (its arena is kept from now on)
+    */
+    struct sh_function *f = findFunction(name);
+    if (f == NULL) {
+        f = malloc(sizeof(struct sh_function));
+        f->name = strdup(name);
+        f->next = functions;
+        functions = f;
+    }
+    f->body = body;
+    keepCompiled = 1;
+}
+
+// compiled commands run pipelines that can call functions that run compiled commands
+void execNodes(struct sh_node *node);
+void execNode(struct sh_node *node);
+
+void callFunction(struct sh_function *f, struct sh_command *newCommand) {
+    /*
+    Run a function in the shell with the command's words as $1.. and its redirections of fds 0-2 applied around it
+    :param: function, parsed command calling it
+    */
+    int saved[3];
+    char **outerArgs = posArgs;
+    int outerCount = posCount;
+
+    if (funcDepth == MAX_DEPTH) {
+        printf("%s: maximum function nesting exceeded\n", newCommand->args[0]);
+        fflush(stdout);
+        statusVar = 1;
+        return;
+    }
+    if (redirectBuiltIn(newCommand, saved) == 1) {
+        statusVar = 1;
+        return;
+    }
+    posArgs = newCommand->args + 1;
+    posCount = newCommand->argc - 1;
+    funcDepth++;
+    // an empty body succeeds
+    statusVar = 0;
+    execNodes(f->body);
+    funcDepth--;
+    returning = 0;
+    posArgs = outerArgs;
+    posCount = outerCount;
+    restoreBuiltIn(saved);
+}
+
+void execPipeline(struct sh_pipeline *pipeline) {
+    /*
+    Run a parsed, expanded pipeline: an assignment, a function call, a built-in, or a job of external commands
+    :param: pipeline struct
+    */
+    struct sh_command *first = pipeline->first;
+    struct sh_function *f;
+    struct sh_redirect *r;
+    char *equals;
+
+    // nothing but blanks
+    if (first->argc == 0) {
+        return;
+    }
+
+    // timeout and cpus/nice/ioprio/limit prefixes come off the command
+    if (stripPrefixes(pipeline) == -1) {
+        statusVar = 1;
+        return;
+    }
+
+    // NAME=value on its own sets a variable, kept in the environment where $NAME looks
+    if (pipeline->count == 1 && first->argc == 1 && first->redirects == NULL &&
+        (equals = assignment(first->args[0])) != NULL) {
+        *equals = '\0';
+        setenv(first->args[0], equals + 1, 1);
+        *equals = '=';
+        // x=$(cmd) has cmd's status
+        if (substituted == 0) {
+            statusVar = 0;
+        }
+        return;
+    }
+
+    // functions run in the shell, in a pipeline, the background or under a prefix the name goes to PATH like any
+    // command
+    if (functions != NULL && pipeline->count == 1 && first->background == 0 && first->external == 0 &&
+        (f = findFunction(first->args[0])) != NULL) {
+        for (r = first->redirects; r != NULL && r->fd <= 2; r = r->next);
+        if (r == NULL) {
+            callFunction(f, first);
+            return;
+        }
+    }
+
+    // caught a built-in, timed in-process when asked
+    struct timespec builtInStart;
+    struct rusage builtInUsage;
+    if (pipeline->timed == 1) {
+        clock_gettime(CLOCK_MONOTONIC, &builtInStart);
+        getrusage(RUSAGE_SELF, &builtInUsage);
+    }
+    long long runStart = traceFile != NULL ? nowNanos() : 0;
+    if (checkBuiltIns(first) == 1) {
+        if (traceFile != NULL) {
+            traceBuiltIn(pipeline, runStart, nowNanos());
+        }
+        if (pipeline->timed == 1) {
+            struct timespec builtInEnd;
+            struct rusage after;
+            double real;
+            clock_gettime(CLOCK_MONOTONIC, &builtInEnd);
+            getrusage(RUSAGE_SELF, &after);
+            elapsedSince(&builtInStart, &builtInEnd, &real);
+            // charge only what the builtin used
+            timersub(&after.ru_utime, &builtInUsage.ru_utime, &after.ru_utime);
+            timersub(&after.ru_stime, &builtInUsage.ru_stime, &after.ru_stime);
+            after.ru_nvcsw -= builtInUsage.ru_nvcsw;
+            after.ru_nivcsw -= builtInUsage.ru_nivcsw;
+            printTimes(stderr, real, &after);
+            fprintf(stderr, "\n");
+        }
+        return;
+    }
+
+    // start every stage, then wait or go to the background
+    runPipeline(pipeline);
+}
+
+int expandStage(struct sh_pipeline *pipeline, struct sh_command *tmpl, struct sh_command *newCommand) {
+    /*
+    Give a stage copied from a compiled command its expanded words and redirection targets
+    :param: pipeline being built, compiled stage, new stage
+    :retrn: 0, -1 when a redirection target is unusable
+    */
+    struct sh_redirect *r;
+    int argCount = 0;
+    int i;
+
+    // words are collected in argScratch, command output can split into any number of them
+    for (i = 0; i < tmpl->argc; i++) {
+        char *word = tmpl->args[i];
+        if (strchr(word, '$') != NULL) {
+            word = expandWord(&pipeline->arena, word, strlen(word));
+            // a word that expanded to nothing disappears, as when the line is parsed
+            if (word[0] == '\0') {
+                continue;
+            }
+            if (strstr(tmpl->args[i], "$(") != NULL) {
+                if ((argCount = splitFields(word, argCount)) == -1) {
+                    return -1;
+                }
+                continue;
+            }
+        }
+        if (globChars(tmpl->args[i]) == 1) {
+            if ((argCount = globWord(&pipeline->arena, word, argCount)) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        if (argRoom(argCount) == -1) {
+            return -1;
+        }
+        argScratch[argCount++] = word;
+    }
+    if (argCount > 0) {
+        endStage(pipeline, newCommand, argCount);
+    }
+
+    for (r = tmpl->redirects; r != NULL; r = r->next) {
+        char *target = r->target;
+        if (strchr(target, '$') != NULL) {
+            target = expandWord(&pipeline->arena, target, strlen(target));
+        }
+        struct sh_redirect *copy = addRedirect(pipeline, newCommand, r->fd, r->kind);
+        if (setRedirectTarget(pipeline, newCommand, copy, target) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void runTemplate(struct sh_pipeline *tmpl) {
+    /*
+    Run a compiled simple command - its stages are copied into this nesting level's scratch pipeline and only
+    the words holding $ are expanded again, nothing is re-parsed
+    :param: compiled pipeline
+    */
+    struct sh_pipeline *pipeline;
+    struct sh_command *t;
+
+    if (execDepth == MAX_DEPTH) {
+        printf("Maximum nesting depth exceeded\n");
+        fflush(stdout);
+        statusVar = 1;
+        return;
+    }
+    // the level is taken before expanding, a $(...) running compiled commands nests one deeper
+    pipeline = &scratch[execDepth++];
+    pipeline->text = tmpl->text;
+    pipeline->timed = tmpl->timed;
+    // & was kept at compile time, foreground-only mode applies when the command runs
+    pipeline->background = allow_bg == 0 ? tmpl->background : 0;
+    substituted = 0;
+
+    for (t = tmpl->first; t != NULL; t = t->next) {
+        struct sh_command *newCommand = addStage(pipeline);
+        newCommand->background = pipeline->background;
+        if (tmpl->deferred == 0) {
+            newCommand->command = t->command;
+            newCommand->args = t->args;
+            newCommand->argc = t->argc;
+            newCommand->redirects = t->redirects;
+            newCommand->lastRedirect = t->lastRedirect;
+        } else if (expandStage(pipeline, t, newCommand) == -1) {
+            break;
+        } else if (newCommand->argc == 0 && tmpl->count > 1) {
+            printf("Missing command in pipeline\n");
+            fflush(stdout);
+            break;
+        }
+    }
+
+    if (t == NULL) {
+        execPipeline(pipeline);
+    } else {
+        statusVar = 1;
+    }
+    execDepth--;
+    freePipeline(pipeline);
+}
+
+int leaveLoop(void) {
+    /*
+    Settle a break or continue that has reached the loop after its body ran
+    :retrn: 1 when the loop stops, 0 to go round again
+    */
+    if (breakLevels > 0) {
+        breakLevels--;
+        return 1;
+    }
+    if (continueLevels > 0) {
+        // continue n keeps leaving loops until the nth one
+        continueLevels--;
+        return continueLevels > 0;
+    }
+    return returning == 1 || to_exit == 1;
+}
+
+void execLoop(struct sh_node *node) {
+    /*
+    while/until - run the body as long as the condition succeeds (fails)
+    :param: loop node
+    */
+    int status = 0;
+
+    loopDepth++;
+    while (1) {
+        execNodes(node->cond);
+        if (breakLevels > 0 || continueLevels > 0 || returning == 1 || to_exit == 1) {
+            if (leaveLoop() == 1) {
+                break;
+            }
+            continue;
+        }
+        if ((statusVar == 0) != (node->kind == NODE_WHILE)) {
+            break;
+        }
+        execNodes(node->body);
+        status = statusVar;
+        if (leaveLoop() == 1) {
+            break;
+        }
+    }
+    loopDepth--;
+    statusVar = status;
+}
+
+char *forEntry(struct arena *a, char *name, char *value, size_t valueLen) {
+    /*
+    Build the NAME=value string a for loop puts straight into the environment
+    :param: arena, variable name, value, value length
+    :retrn: entry in the arena
+    */
+    size_t nameLen = strlen(name);
+    char *entry = arenaAlloc(a, nameLen + valueLen + 2);
+    memcpy(entry, name, nameLen);
+    entry[nameLen] = '=';
+    memcpy(entry + nameLen + 1, value, valueLen);
+    entry[nameLen + valueLen + 1] = '\0';
+    return entry;
+}
+
+void execFor(struct sh_node *node) {
+    /*
+    for - set the variable to each word in turn and run the body. The NAME=word entries are built before the loop
+    (at compile time for a list without $) and swapped into the variable's environ slot, so a pass neither copies
+    the value nor searches the environment. Words holding $ are expanded and split on blanks first, no word list loops over the
+    function's arguments
+    :param: for node
+    */
+    struct arena expanded = {0};
+    char **entries = node->entries;
+    char **env = NULL;
+    char **slot = NULL;
+    int count = 0;
+    int cap = 16;
+    int status = 0;
+    int i;
+
+    if (entries != NULL) {
+        while (entries[count] != NULL) {
+            count++;
+        }
+    } else if (node->words == NULL) {
+        entries = malloc((posCount + 1) * sizeof(char *));
+        for (count = 0; count < posCount; count++) {
+            entries[count] = forEntry(&expanded, node->name, posArgs[count], strlen(posArgs[count]));
+        }
+    } else {
+        char **w;
+        entries = malloc(cap * sizeof(char *));
+        for (w = node->words; *w != NULL; w++) {
+            char *field = *w;
+            char *save = NULL;
+            if (strchr(*w, '$') != NULL) {
+                char *text = expandWord(&expanded, *w, strlen(*w));
+                field = strtok_r(text, " \t\n", &save);
+            } else if (globChars(*w) == 1) {
+                // matches come back in argScratch, which the body is free to reuse once they are copied
+                int matches = globWord(&expanded, *w, 0);
+                for (i = 0; i < matches; i++) {
+                    if (count == cap) {
+                        cap *= 2;
+                        entries = realloc(entries, cap * sizeof(char *));
+                    }
+                    entries[count++] = forEntry(&expanded, node->name, argScratch[i], strlen(argScratch[i]));
+                }
+                continue;
+            }
+            while (field != NULL) {
+                if (count == cap) {
+                    cap *= 2;
+                    entries = realloc(entries, cap * sizeof(char *));
+                }
+                entries[count++] = forEntry(&expanded, node->name, field, strlen(field));
+                field = save != NULL ? strtok_r(NULL, " \t\n", &save) : NULL;
+            }
+        }
+    }
+
+    loopDepth++;
+    for (i = 0; i < count; i++) {
+        // while the body leaves the environment alone the previous entry's slot is reused, putenv scans for it
+        if (slot != NULL && environ == env && *slot == entries[i - 1]) {
+            *slot = entries[i];
+        } else {
+            putenv(entries[i]);
+            env = environ;
+            for (slot = environ; slot != NULL && *slot != NULL && *slot != entries[i]; slot++);
+            if (slot != NULL && *slot == NULL) {
+                slot = NULL;
+            }
+        }
+        execNodes(node->body);
+        status = statusVar;
+        if (leaveLoop() == 1) {
+            break;
+        }
+    }
+    loopDepth--;
+    // the variable keeps its last value in a copy of its own, the entries go away with the loop
+    if (count > 0) {
+        char *value = strchr(entries[i < count ? i : count - 1], '=') + 1;
+        if (getenv(node->name) == value) {
+            setenv(node->name, value, 1);
+        }
+    }
+    statusVar = status;
+
+    if (entries != node->entries) {
+        free(entries);
+        arenaFree(&expanded);
+    }
+}
+
+void execAndOr(struct sh_node *node) {
+    /*
+    Run an && / || list - the right side runs only when the left side's status calls for it
+    :param: list node
+    */
+    execNode(node->cond);
+    if (breakLevels > 0 || continueLevels > 0 || returning == 1 || to_exit == 1) {
+        return;
+    }
+    if ((statusVar == 0) == (node->kind == NODE_AND)) {
+        execNode(node->body);
+    }
+}
+
+void childShell(void) {
+    /*
+    Forget the parent's jobs in a forked copy of the shell - they aren't its children to reap, time out or list
+    */
+    jobList = NULL;
+    doneJobs = 0;
+    queuedJobs = 0;
+    inCopy = 1;
+    if (deadlineFD != -1) {
+        close(deadlineFD);
+        deadlineFD = -1;
+    }
+    armedAt = 0;
+}
+
+pid_t forkList(struct sh_node *node, struct sh_pipeline *job, int *outRead) {
+    /*
+    Fork the copy of the shell that runs an && / || list job, with its output captured or discarded like any &
+    command's
+    :param: list node, pipeline standing for the job, where to put the capture's read end for captureAttach
+    :retrn: PID of the copy, also the job's process group, -1 if fork failed
+    */
+    pid_t pid;
+
+    *outRead = captureStart(job);
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        captureAttach(NULL, job, *outRead);
+        return -1;
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        childShell();
+        listGroup = getpid();
+        // the terminal stays with the shell
+        jobControl = 0;
+        // like any background command, output is discarded unless it is captured
+        if (job->captureFD > 0) {
+            dup2(job->captureFD, STDOUT_FILENO);
+            dup2(job->captureFD, STDERR_FILENO);
+        } else {
+            dup2(nullFD(), STDOUT_FILENO);
+        }
+        execAndOr(node);
+        fflush(stdout);
+        _exit(statusVar);
+    }
+    setpgid(pid, pid);
+    return pid;
+}
+
+void runListJob(struct sh_node *node) {
+    /*
+    Run an && / || list ending in & as one background job - a forked copy of the shell runs the list, and every
+    command it starts joins the copy's process group, so the job can be listed, waited for and killed as a whole.
+    Beyond maxjobs the list is queued like any & job
+    :param: list node
+    */
+    struct sh_pipeline job = {0};
+    struct sh_job *entry;
+    pid_t pid;
+    int outRead;
+
+    job.background = 1;
+    job.count = 1;
+    job.text = node->text;
+    if (maxJobs > 0 && (queuedJobs > 0 || runningJobs() >= maxJobs)) {
+        entry = newJob(&job);
+        entry->state = JOB_QUEUED;
+        entry->queued = 1;
+        entry->pendingList = node;
+        // the node lives in the line's compile arena
+        keepCompiled = 1;
+        queuedJobs++;
+        printf("Queued job [%d], %d waiting\n", entry->id, queuedJobs);
+        fflush(stdout);
+        return;
+    }
+    pid = forkList(node, &job, &outRead);
+    if (pid == -1) {
+        statusVar = 1;
+        return;
+    }
+
+    entry = addJob(pid, &pid, 1, &job);
+    captureAttach(entry, &job, outRead);
+    lastBgPID = pid;
+    printf("Background PID is %d\n", pid);
+    fflush(stdout);
+}
+
+void execNode(struct sh_node *node) {
+    /*
+    Run one compiled command
+    :param: node
+    */
+    switch (node->kind) {
+    case NODE_SIMPLE:
+        runTemplate(node->command);
+        break;
+    case NODE_IF:
+        execNodes(node->cond);
+        if (breakLevels > 0 || continueLevels > 0 || returning == 1 || to_exit == 1) {
+            break;
+        }
+        if (statusVar == 0) {
+            execNodes(node->body);
+        } else if (node->elseBody != NULL) {
+            execNodes(node->elseBody);
+        } else {
+            // no branch taken succeeds
+            statusVar = 0;
+        }
+        break;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+        execLoop(node);
+        break;
+    case NODE_FOR:
+        execFor(node);
+        break;
+    case NODE_FUNCTION:
+        defineFunction(node->name, node->body);
+        statusVar = 0;
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        // & is ignored in foreground-only mode, as for single commands
+        if (node->background == 1 && allow_bg == 0) {
+            runListJob(node);
+        } else {
+            execAndOr(node);
+        }
+        break;
+    }
+}
+
+void execNodes(struct sh_node *node) {
+    /*
+    Run a list of compiled commands, stopping early for break, continue, return or exit
+    :param: first node of the list
+    */
+    for (; node != NULL; node = node->next) {
+        if (breakLevels > 0 || continueLevels > 0 || returning == 1 || to_exit == 1) {
+            return;
+        }
+        execNode(node);
+    }
+}
+
+int keyword(char *segment, char *word, char **rest) {
+    /*
+    Check whether a segment starts with a reserved word
+    :param: segment, reserved word, where to put the text after it (blanks skipped)
+    :retrn: 1 when it does
+    */
+    size_t len = strlen(word);
+    if (strncmp(segment, word, len) != 0 || (segment[len] != '\0' && segment[len] != ' ' && segment[len] != '\t')) {
+        return 0;
+    }
+    *rest = segment + len + strspn(segment + len, " \t");
+    return 1;
+}
+
+size_t functionHeader(char *segment, char **name, char **rest) {
+    /*
+    Recognize "name()", "name ()" and "function name" at the start of a segment, without changing it
+    :param: segment, where to put the name and the text after the header
+    :retrn: length of the name, 0 when the segment does not define a function
+    */
+    char *p;
+    int named = keyword(segment, "function", &p);
+    char *start = named == 1 ? p : segment;
+    size_t len = nameLength(start);
+
+    p = start + len;
+    if (len == 0 || (*p != '\0' && *p != ' ' && *p != '\t' && *p != '(')) {
+        return 0;
+    }
+    p += strspn(p, " \t");
+    if (p[0] == '(' && p[1] == ')') {
+        p += 2;
+    } else if (named == 0) {
+        return 0;
+    }
+    *name = start;
+    *rest = p + strspn(p, " \t");
+    return len;
+}
+
+char *listEnd(char *segment) {
+    /*
+    Find where a command ends in a line - at ;, && or ||, or at an & standing alone with more text after it
+    :param: start of the command
+    :retrn: the operator, or the end of the line
+    */
+    char *end = segment;
+    while (*end != '\0' && *end != ';' && !(end[0] == '&' && end[1] == '&') && !(end[0] == '|' && end[1] == '|') &&
+           !(*end == '&' && (end == segment || end[-1] == ' ' || end[-1] == '\t') && (end[1] == ' ' || end[1] == '\t'))) {
+        // operators inside $(...) belong to the substituted command
+        if (end[0] == '$' && end[1] == '(' && substEnd(end) != NULL) {
+            end = substEnd(end);
+            continue;
+        }
+        end++;
+    }
+    return end;
+}
+
+int strayParen(char *line) {
+    /*
+    Check the commands of a line for a ( or ) that isn't shell syntax - outside every $(...) and not the () of a
+    function header. sh rejects such a line, here it was written for one command per line (as in
+    "echo notes; more notes (with parens)") and is never split into a list
+    :param: input line
+    :retrn: 1 when there is one
+    */
+    char *segment = line;
+    char *end;
+    char *name;
+    char *p;
+
+    while (1) {
+        segment += strspn(segment, " \t");
+        end = listEnd(segment);
+        if (functionHeader(segment, &name, &p) == 0) {
+            p = segment;
+        }
+        for (; p < end; p++) {
+            if (p[0] == '$' && p[1] == '(' && substEnd(p) != NULL) {
+                p = substEnd(p) - 1;
+            } else if (*p == '(' || *p == ')') {
+                return 1;
+            }
+        }
+        if (*end == '\0') {
+            return 0;
+        }
+        // past the operator - && and || take two characters
+        segment = end + (end[1] == end[0] ? 2 : 1);
+    }
+}
+
+int compoundLine(char *line) {
+    /*
+    Check whether a line has to be compiled - it starts a loop, an if, a function definition, or a reserved word
+    out of place, or it is a list of commands joined with ;, &&, || or &
+    :param: input line
+    :retrn: 1 when it does
+    */
+    static char *reserved[] = {"if", "while", "until", "for", "then", "elif", "else", "fi", "do", "done", "{", "}",
+                               NULL};
+    char **word;
+    char *name;
+    char *rest;
+
+    line += strspn(line, " \t");
+    for (word = reserved; *word != NULL; word++) {
+        if (keyword(line, *word, &rest) == 1) {
+            return 1;
+        }
+    }
+    if (functionHeader(line, &name, &rest) > 0) {
+        return 1;
+    }
+    if (strayParen(line) == 1) {
+        return 0;
+    }
+    // any ;, && or ||, or an & with a command after it (a trailing & belongs to a plain command)
+    rest = listEnd(line);
+    return *rest != '\0' && (rest[0] != '&' || rest[1] == '&' || rest[1 + strspn(rest + 1, " \t")] != '\0');
+}
+
+char *nextSegment(struct compile_src *src) {
+    /*
+    Next command to compile - lines are copied into the arena and split on ;, && and ||, reading more input (with a
+    "> " prompt) as a compound command or list needs it. Blank segments and comment lines are skipped
+    :param: compile source
+    :retrn: segment without surrounding blanks (src->joiner says what followed it), NULL at end of input or after
+            a syntax error
+    */
+    char *segment = src->pushed;
+    size_t len;
+
+    if (segment != NULL) {
+        src->pushed = NULL;
+        return segment;
+    }
+    while (1) {
+        if (src->rest == NULL) {
+            if (showPrompt == 1) {
+                printf("> ");
+                fflush(stdout);
+            }
+            char *line = readLine(src->reader);
+            if (line == NULL) {
+                return NULL;
+            }
+            len = strlen(line);
+            src->rest = arenaAlloc(src->arena, len + 1);
+            memcpy(src->rest, line, len + 1);
+        }
+        segment = src->rest + strspn(src->rest, " \t");
+        // a comment runs to the end of the line
+        if (segment[0] == '#') {
+            src->rest = NULL;
+            continue;
+        }
+        // a command ends at ;, &&, || or after a standalone &
+        char *end = listEnd(segment);
+        int joiner = 0;
+        if (end[0] == '&' && end[1] == '&') {
+            joiner = NODE_AND;
+        } else if (end[0] == '|') {
+            joiner = NODE_OR;
+        }
+        if (joiner != 0) {
+            *end = '\0';
+            src->rest = end + 2;
+        } else {
+            if (*end == '&') {
+                end++;
+            }
+            if (*end != '\0') {
+                *end = '\0';
+                src->rest = end + 1;
+            } else {
+                src->rest = NULL;
+            }
+        }
+        len = strlen(segment);
+        while (len > 0 && (segment[len - 1] == ' ' || segment[len - 1] == '\t')) {
+            segment[--len] = '\0';
+        }
+        if (len > 0) {
+            src->joiner = joiner;
+            return segment;
+        }
+        if (joiner != 0) {
+            printf("syntax error near unexpected %s\n", joiner == NODE_AND ? "&&" : "||");
+            fflush(stdout);
+            src->error = 1;
+            return NULL;
+        }
+    }
+}
+
+struct sh_node *compileCommand(struct compile_src *src, char *segment);
+char *nodeText(struct sh_node *node) {
+    /*
+    Text standing for a compiled command in the job table
+    :param: node
+    :retrn: the simple command as typed, the list's text, or the keyword of a compound command
+    */
+    static char *keywords[] = {"", "if ...", "while ...", "until ...", "for ...", "function ..."};
+    if (node->kind == NODE_SIMPLE) {
+        return node->command != NULL ? node->command->text : "";
+    }
+    if (node->kind == NODE_AND || node->kind == NODE_OR) {
+        return node->text;
+    }
+    return keywords[node->kind];
+}
+
+struct sh_node *compileAndOr(struct compile_src *src, char *segment) {
+    /*
+    Compile a command and any commands joined to it with && or || (left to right, equal precedence). An & on the
+    last command backgrounds the whole list as one job
+    :param: compile source, segment the list starts with
+    :retrn: node, src->error is set on a syntax error
+    */
+    struct sh_node *node = compileCommand(src, segment);
+
+    while (src->error == 0 && src->joiner != 0) {
+        int kind = src->joiner;
+        char *next = nextSegment(src);
+        struct sh_node *list;
+        char *left;
+        char *right;
+        size_t len;
+
+        if (next == NULL) {
+            if (src->error == 0) {
+                printf("syntax error: unexpected end of input after %s\n", kind == NODE_AND ? "&&" : "||");
+                fflush(stdout);
+                src->error = 1;
+            }
+            return node;
+        }
+        list = arenaAlloc(src->arena, sizeof(struct sh_node));
+        memset(list, 0, sizeof(struct sh_node));
+        list->kind = kind;
+        list->cond = node;
+        list->body = compileCommand(src, next);
+        if (src->error == 1) {
+            return list;
+        }
+        left = nodeText(list->cond);
+        right = nodeText(list->body);
+        len = strlen(left) + strlen(right) + 5;
+        list->text = arenaAlloc(src->arena, len);
+        snprintf(list->text, len, "%s %s %s", left, kind == NODE_AND ? "&&" : "||", right);
+        node = list;
+    }
+
+    // the & parsed onto the last command belongs to the list
+    if ((node->kind == NODE_AND || node->kind == NODE_OR) && node->body->kind == NODE_SIMPLE &&
+        node->body->command != NULL && node->body->command->background == 1) {
+        node->body->command->background = 0;
+        node->background = 1;
+    }
+    return node;
+}
+
+
+struct sh_node *compileList(struct compile_src *src, char **ends, char **found) {
+    /*
+    Compile commands up to one of the reserved words that can end the list
+    :param: compile source, reserved words ending the list (the expected one first), where to put the one found
+    :retrn: first node of the list (NULL for an empty list), src->error is set on a syntax error
+    */
+    struct sh_node *head = NULL;
+    struct sh_node **tail = &head;
+    char **end;
+    char *rest;
+
+    while (1) {
+        char *segment = nextSegment(src);
+        if (segment == NULL) {
+            if (src->error == 0) {
+                printf("syntax error: unexpected end of input, expected %s\n", ends[0]);
+                fflush(stdout);
+                src->error = 1;
+            }
+            return NULL;
+        }
+        for (end = ends; *end != NULL; end++) {
+            if (keyword(segment, *end, &rest) == 1) {
+                // a compound command takes no redirections, pipes or & after its closing word
+                if (*rest != '\0' && (strcmp(*end, "fi") == 0 || strcmp(*end, "done") == 0 ||
+                                       strcmp(*end, "}") == 0)) {
+                    printf("syntax error: %s after %s is not supported\n", rest, *end);
+                    fflush(stdout);
+                    src->error = 1;
+                    return NULL;
+                }
+                // the rest of the segment is the next command, as in "then echo yes"
+                if (*rest != '\0') {
+                    src->pushed = rest;
+                }
+                *found = *end;
+                return head;
+            }
+        }
+        struct sh_node *node = compileAndOr(src, segment);
+        if (src->error == 1) {
+            return NULL;
+        }
+        *tail = node;
+        tail = &node->next;
+    }
+}
+
+void compileIf(struct compile_src *src, struct sh_node *node) {
+    /*
+    Compile an if (or elif) from its condition to the matching fi
+    :param: compile source, node to fill in
+    */
+    static char *thenEnds[] = {"then", NULL};
+    static char *bodyEnds[] = {"fi", "elif", "else", NULL};
+    static char *elseEnds[] = {"fi", NULL};
+    char *found;
+
+    node->kind = NODE_IF;
+    node->cond = compileList(src, thenEnds, &found);
+    if (src->error == 1) {
+        return;
+    }
+    node->body = compileList(src, bodyEnds, &found);
+    if (src->error == 1) {
+        return;
+    }
+    if (strcmp(found, "elif") == 0) {
+        // elif is an if nested in the else branch, sharing its fi
+        node->elseBody = arenaAlloc(src->arena, sizeof(struct sh_node));
+        memset(node->elseBody, 0, sizeof(struct sh_node));
+        compileIf(src, node->elseBody);
+    } else if (strcmp(found, "else") == 0) {
+        node->elseBody = compileList(src, elseEnds, &found);
+    }
+}
+
+struct sh_pipeline *compileSimple(struct compile_src *src, char *segment) {
+    /*
+    Parse a simple command once, leaving its $ words to be expanded each time it runs
+    :param: compile source, segment (cut into words in place)
+    :retrn: parsed pipeline in the compile arena, NULL when the line is rejected
+    */
+    struct sh_pipeline *pipeline = arenaAlloc(src->arena, sizeof(struct sh_pipeline));
+    int result;
+
+    memset(pipeline, 0, sizeof(struct sh_pipeline));
+    // parse straight into the compile arena
+    pipeline->arena = *src->arena;
+    compiling = 1;
+    result = parseInput(segment, pipeline);
+    compiling = 0;
+    *src->arena = pipeline->arena;
+    memset(&pipeline->arena, 0, sizeof(struct arena));
+    if (result == -1) {
+        src->error = 1;
+        return NULL;
+    }
+    return pipeline;
+}
+
+struct sh_node *compileCommand(struct compile_src *src, char *segment) {
+    /*
+    Compile one command - if, while, until, for, a function definition, or a simple command
+    :param: compile source, segment it starts with
+    :retrn: node, src->error is set on a syntax error
+    */
+    static char *doEnds[] = {"do", NULL};
+    static char *doneEnds[] = {"done", NULL};
+    static char *openEnds[] = {"{", NULL};
+    static char *closeEnds[] = {"}", NULL};
+    static char *misplaced[] = {"then", "elif", "else", "fi", "do", "done", "{", "}", NULL};
+    struct sh_node *node = arenaAlloc(src->arena, sizeof(struct sh_node));
+    char **word;
+    char *found;
+    char *rest;
+    char *name;
+    size_t len;
+
+    memset(node, 0, sizeof(struct sh_node));
+
+    if (keyword(segment, "if", &rest) == 1) {
+        if (*rest != '\0') {
+            src->pushed = rest;
+        }
+        compileIf(src, node);
+        return node;
+    }
+
+    if (keyword(segment, "while", &rest) == 1 || keyword(segment, "until", &rest) == 1) {
+        node->kind = segment[0] == 'w' ? NODE_WHILE : NODE_UNTIL;
+        if (*rest != '\0') {
+            src->pushed = rest;
+        }
+        node->cond = compileList(src, doEnds, &found);
+        if (src->error == 0) {
+            node->body = compileList(src, doneEnds, &found);
+        }
+        return node;
+    }
+
+    if (keyword(segment, "for", &rest) == 1) {
+        node->kind = NODE_FOR;
+        node->name = rest;
+        len = strcspn(rest, " \t");
+        rest += len;
+        if (*rest != '\0') {
+            *rest++ = '\0';
+            rest += strspn(rest, " \t");
+        }
+        if (len == 0 || nameLength(node->name) != len) {
+            printf("syntax error: bad for loop variable\n");
+            fflush(stdout);
+            src->error = 1;
+            return node;
+        }
+        // the word list is split once, only words holding $ are left for run time
+        if (keyword(rest, "in", &rest) == 1) {
+            int count = 0;
+            char *p = rest;
+            while (*p != '\0') {
+                count++;
+                p = wordEnd(p);
+                p += strspn(p, " \t");
+            }
+            node->words = arenaAlloc(src->arena, (count + 1) * sizeof(char *));
+            count = 0;
+            while (*rest != '\0') {
+                char *end = wordEnd(rest);
+                node->words[count++] = rest;
+                if (*end != '\0') {
+                    *end++ = '\0';
+                    end += strspn(end, " \t");
+                }
+                // $ words expand and patterns match when the loop runs
+                if (strchr(rest, '$') != NULL || globChars(rest) == 1) {
+                    node->wordsDeferred = 1;
+                }
+                rest = end;
+            }
+            node->words[count] = NULL;
+            if (node->wordsDeferred == 0) {
+                node->entries = arenaAlloc(src->arena, (count + 1) * sizeof(char *));
+                for (count = 0; node->words[count] != NULL; count++) {
+                    node->entries[count] = forEntry(src->arena, node->name, node->words[count],
+                                                    strlen(node->words[count]));
+                }
+                node->entries[count] = NULL;
+            }
+        } else if (*rest != '\0') {
+            src->pushed = rest;
+        }
+        if (compileList(src, doEnds, &found) != NULL && src->error == 0) {
+            printf("syntax error: expected do\n");
+            fflush(stdout);
+            src->error = 1;
+        }
+        if (src->error == 0) {
+            node->body = compileList(src, doneEnds, &found);
+        }
+        return node;
+    }
+
+    if ((len = functionHeader(segment, &name, &rest)) > 0) {
+        node->kind = NODE_FUNCTION;
+        node->name = name;
+        name[len] = '\0';
+        if (*rest != '\0') {
+            src->pushed = rest;
+        }
+        if (compileList(src, openEnds, &found) != NULL && src->error == 0) {
+            printf("syntax error: expected { after %s()\n", node->name);
+            fflush(stdout);
+            src->error = 1;
+        }
+        if (src->error == 0) {
+            node->body = compileList(src, closeEnds, &found);
+        }
+        return node;
+    }
+
+    for (word = misplaced; *word != NULL; word++) {
+        if (keyword(segment, *word, &rest) == 1) {
+            printf("syntax error near unexpected %s\n", *word);
+            fflush(stdout);
+            src->error = 1;
+            return node;
+        }
+    }
+
+    node->kind = NODE_SIMPLE;
+    node->command = compileSimple(src, segment);
+    return node;
+}
+
+void runCompound(struct line_reader *reader, char *line) {
+    /*
+    Compile a line that starts a compound command - plus however many lines it takes to finish it - then run the
+    compiled commands. Loop bodies run from the compiled form, so each pass costs no parsing
+    :param: input reader, the line read
+    */
+    struct arena unit = {0};
+    struct compile_src src = {0};
+    struct sh_node *head = NULL;
+    struct sh_node **tail = &head;
+    size_t len = strlen(line);
+
+    src.reader = reader;
+    src.arena = &unit;
+    src.rest = arenaAlloc(&unit, len + 1);
+    memcpy(src.rest, line, len + 1);
+
+    // everything on the first line is compiled, later lines only while a command is unfinished
+    while (src.pushed != NULL || (src.rest != NULL && src.rest[strspn(src.rest, " \t;")] != '\0' &&
+                                  src.rest[strspn(src.rest, " \t;")] != '#')) {
+        char *segment = nextSegment(&src);
+        if (segment == NULL) {
+            break;
+        }
+        struct sh_node *node = compileAndOr(&src, segment);
+        if (src.error == 1) {
+            break;
+        }
+        *tail = node;
+        tail = &node->next;
+    }
+
+    keepCompiled = 0;
+    if (src.error == 1) {
+        statusVar = 1;
+    } else {
+        execNodes(head);
+        // break or continue with no loop left to settle it
+        breakLevels = 0;
+        continueLevels = 0;
+    }
+    // function bodies point into the arena
+    if (keepCompiled == 0) {
+        arenaFree(&unit);
+    }
+}
+
+pid_t shellCopy(char *line, int outFD, int inFD) {
+    /*
+    Run a line of compiled commands (a list, loop or function definition) as one job in a forked copy of the
+    shell, for callers that launch jobs without waiting in place. Every command it starts joins the copy's
+    process group, so the job can be reaped, timed out and killed as a whole
+    :param: line, descriptor for stdout and for stdin (0 to inherit)
+    :retrn: PID of the copy, also its process group, -1 if fork failed
     */
-    if (c->command != NULL) {
-        free(c->command);
-    }
-    if (c->inputFile != NULL) {
-        free(c->inputFile);
-    }
-    if (c->outputFile != NULL) {
-        free(c->outputFile);
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
     }
-    int i;
-    for (i=0; i < (sizeof(c->args) / sizeof(c->args[0])); i++) {
-        if (c->args[i] != NULL) {
-            free(c->args[i]);
+    if (pid == 0) {
+        struct line_reader reader;
+        struct sigaction dfl_SIGINT = {0};
+        setpgid(0, 0);
+        childShell();
+        listGroup = getpid();
+        jobControl = 0;
+        // ^C ends the copy like any foreground command
+        sigfillset(&dfl_SIGINT.sa_mask);
+        dfl_SIGINT.sa_handler = SIG_DFL;
+        sigaction(SIGINT, &dfl_SIGINT, NULL);
+        if (outFD > 0) {
+            dup2(outFD, STDOUT_FILENO);
+        }
+        if (inFD > 0) {
+            dup2(inFD, STDIN_FILENO);
         }
+        initStringReader(&reader, line);
+        runCompound(&reader, readLine(&reader));
+        fflush(stdout);
+        _exit(statusVar);
     }
+    setpgid(pid, pid);
+    return pid;
 }
 
-char *insertPID(char *command) {
+void readInto(int fd, struct arena *a, char **out, size_t *outLen, size_t *cap) {
     /*
-    convert any instances of $$ to the PID
-    :param: command string
-    :retrn: converted command string
+    Read a descriptor to end of file, appending to a growable arena buffer
+    :param: descriptor, arena, buffer, its length and capacity
     */
-    char temppid[2049]; // to build new string
-    char pid[7];        // hold pid
-
-    // wipe both arrays
-    memset(temppid, '\0', strlen(temppid));
-    memset(pid, '\0', strlen(pid));
-
-    // iterators
-    int i;
-    int j = 0;
-    int k;
-
-    // find pid
-    sprintf(pid, "%d", getpid());
-    fflush(stdout);
-    // iterate command string
-    for (i = 0; i < strlen(command) - 1; i++) {
-        // check for $$
-        if (command[i] == '$' && command[i + 1] == '$') {
-            // replace $$ with PID
-            for (k = 0; k < strlen(pid); k++) {
-                temppid[j] = pid[k];
-                j++;
+    char chunk[4096];
+    ssize_t got;
+    while ((got = read(fd, chunk, sizeof(chunk))) != 0) {
+        if (got == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-            i++;
-        // copy char for char
-        } else {
-            temppid[j] = command[i];
-            j++;
+            break;
         }
+        appendText(a, out, outLen, cap, chunk, got);
     }
-    // write PID string over $$ string
-    memset(command, '\0', strlen(command));
-    strcpy(command, temppid);
-    return command;
 }
 
-int noComment(void) {
+void restoreScratch(char **words, int wordsCap, char ***spare, int *spareCap) {
     /*
-    This will ignore all processing and jump to a new command line when the user either hits enter immediately or types a line beginning with a '#'
-    :retrn: no comment bool
+    Hand the outer parse its scratch argv back, keeping the nested one as the spare
+    :param: outer scratch and its capacity, spare slot and its capacity
     */
-    // check for comment or blank line
-    if (sh_input[0] == '#' || sh_input[0] == '\n') {
-        return 0;
-    }
-    return 1;
+    free(*spare);
+    *spare = argScratch;
+    *spareCap = argCap;
+    argScratch = words;
+    argCap = wordsCap;
 }
 
-int checkBuiltIns(char *temp, char *token, char *ptr) {
+void substitute(struct arena *a, char **out, size_t *outLen, size_t *cap, char *text, size_t len) {
     /*
-    Search the first token of the command string for built-in commands exit, cd, and status.
-    Exit - leave the shell
-    cd <directory>- change directory (no directory goes to HOME)
-    status - return exit status of last exited program
-    :param: user command string, first token, token pointer
-    :retrn: command recognized bool
+    $(command) - run the command and append its stdout, less trailing newlines, to the word being expanded.
+    A lone utility builtin runs in the shell with stdout on a reusable memfd. Other builtins, functions and
+    compound commands run in a forked copy of the shell, external pipelines are launched directly; both write
+    into a pipe read here, then the job is waited for. $? becomes the command's status
+    :param: arena, expanded word buffer, its length and capacity, command text (not terminated), its length
     */
-    char workingDir[2049] = {'\0'};
+    static int substFD = -1;
+    // scratch argv for the nested parse, kept from one substitution to the next
+    static char **spare = NULL;
+    static int spareCap = 0;
+    char **words = argScratch;
+    int wordsCap = argCap;
+    struct sh_pipeline sub = {0};
+    struct sh_builtin *entry = NULL;
+    struct sh_command *stage;
+    struct sh_redirect *r = NULL;
+    size_t start = *outLen;
+    int inShell = 0;
+    int fds[2];
+    int parsed = 0;
+    char *line = malloc(len + 1);
 
-    // handle exit command
-    if (strncmp(token, "exit", 4) == 0) {
-        printf("Goodbye!\n");
-        fflush(stdout);
-        to_exit = 1;
-        return 1;
+    memcpy(line, text, len);
+    line[len] = '\0';
 
-    // handle cd command
-    } else if (strncmp(token, "cd", 2) == 0) {
+    // the words of the line being parsed are in argScratch, the nested parse gets a scratch argv of its own
+    argScratch = spare;
+    argCap = spareCap;
+    // a nested $(...) takes the spare in turn, it must not see a capacity without its array
+    spare = NULL;
+    spareCap = 0;
+    if (compoundLine(line) == 1) {
+        inShell = 1;
+    } else if ((parsed = parseInput(line, &sub)) == -1 || sub.first->argc == 0 || stripPrefixes(&sub) == -1) {
+        restoreScratch(words, wordsCap, &spare, &spareCap);
+        // $() is empty and succeeds, a rejected command or prefix fails
+        statusVar = parsed == -1 || sub.first->argc > 0;
+        substituted = 1;
+        freePipeline(&sub);
+        arenaFree(&sub.arena);
+        free(line);
+        return;
+    } else {
+        parsed = 1;
+        for (stage = sub.first; stage != NULL; stage = stage->next) {
+            if (findBuiltIn(stage->args[0]) != NULL || findFunction(stage->args[0]) != NULL ||
+                (stage->argc == 1 && assignment(stage->args[0]) != NULL)) {
+                inShell = 1;
+            }
+        }
+        sub.background = 0;
+        sub.first->background = 0;
+        entry = findBuiltIn(sub.first->args[0]);
+        for (r = sub.first->redirects; r != NULL && r->fd <= 2; r = r->next);
+    }
+    restoreScratch(words, wordsCap, &spare, &spareCap);
 
-        // change to home directory
-        if (ptr[0] == '\000') {
-            char *curDir = calloc(strlen(getenv("HOME") + 1), sizeof(char));
-            curDir = getenv("HOME");
+    // a utility alone needs no process at all
+    if (parsed == 1 && sub.count == 1 && entry != NULL && entry->utility == 1 && r == NULL &&
+        (substFD != -1 || (substFD = memfd_create("smallsh-subst", MFD_CLOEXEC)) != -1)) {
+        fflush(stdout);
+        int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(substFD, STDOUT_FILENO);
+        checkBuiltIns(sub.first);
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+        // fd 1 moved the shared offset, read back from the start
+        lseek(substFD, 0, SEEK_SET);
+        readInto(substFD, a, out, outLen, cap);
+        ftruncate(substFD, 0);
+        lseek(substFD, 0, SEEK_SET);
+    } else if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("Cannot create pipe");
+        statusVar = 1;
+    } else {
+        pid_t *pids = malloc((parsed == 1 ? sub.count : 1) * sizeof(pid_t));
+        pid_t pgid;
+        struct sh_job *job = NULL;
 
-            // changes directory in if statement, enters on error
-            if (chdir(curDir) != 0) {
-                printf("Error finding home.\n");
-                fflush(stdout);
-                return 1;
-            } else{
-                // wipe workingDir to length of current contents, fill with cwd
-                memset(workingDir, '\0', strlen(workingDir));
-                getcwd(workingDir, sizeof(workingDir));
-                printf("%s\n", workingDir);
+        if (inShell == 1) {
+            // a copy of the shell runs it as its own job, owning the terminal for its children meanwhile
+            fflush(stdout);
+            pgid = fork();
+            if (pgid == 0) {
+                struct line_reader reader;
+                setpgid(0, 0);
+                childShell();
+                shellPGID = getpgrp();
+                if (jobControl == 1) {
+                    tcsetpgrp(STDIN_FILENO, shellPGID);
+                }
+                // ^C ends the copy like any foreground command
+                struct sigaction dfl_SIGINT = {0};
+                sigfillset(&dfl_SIGINT.sa_mask);
+                dfl_SIGINT.sa_handler = SIG_DFL;
+                sigaction(SIGINT, &dfl_SIGINT, NULL);
+                dup2(fds[1], STDOUT_FILENO);
+                close(fds[0]);
+                close(fds[1]);
+                if (parsed == 1) {
+                    execPipeline(&sub);
+                } else {
+                    initStringReader(&reader, line);
+                    char *first = readLine(&reader);
+                    runCompound(&reader, first);
+                }
                 fflush(stdout);
+                _exit(statusVar);
             }
-        // change to directory from root
-        } else if (ptr[0] == '/') {
-
-            // var to store dirname
-            char *newDir = strtok(ptr, "\0");
-            // changes directory in if statement, enters on error
-            if (chdir(newDir) != 0) {
-                // wipe workingDir to length of current contents, fill with cwd
-                memset(workingDir, '\0', strlen(workingDir));
-                getcwd(workingDir, sizeof(workingDir));
-                printf("No such directory: %s\n%s\n", newDir, workingDir);
-                fflush(stdout);
-                return 1;
-            } else{
-                // wipe workingDir to length of current contents, fill with cwd
-                memset(workingDir, '\0', strlen(workingDir));
-                getcwd(workingDir, sizeof(workingDir));
-                printf("%s\n", workingDir);
-                fflush(stdout);
+            if (pgid != -1) {
+                setpgid(pgid, pgid);
             }
-        // change to new directory from relative path
+            pids[0] = pgid;
+            sub.count = 1;
+            if (sub.text == NULL) {
+                sub.text = line;
+            }
+        } else {
+            sub.captureFD = fds[1];
+            pgid = launchPipeline(&sub, pids);
+        }
+        close(fds[1]);
+        if (pgid != -1) {
+            job = addJob(pgid, pids, sub.count, &sub);
+        }
+        readInto(fds[0], a, out, outLen, cap);
+        close(fds[0]);
+        if (job != NULL) {
+            waitJob(job);
         } else {
+            statusVar = 1;
+        }
+        free(pids);
+    }
 
-            // wipe workingDir to length of current contents, fill with cwd
-            memset(workingDir, '\0', strlen(workingDir));
-            getcwd(workingDir, sizeof(workingDir));
-            char *curDir = calloc(strlen(workingDir) + strlen(ptr) + 2, sizeof(char));
-
-            // add new directory onto current path
-            strcpy(curDir, workingDir);
-            strcat(curDir, "/");
-            strcat(curDir, ptr);
-
-            // changes directory in if statement, enters on error
-            if (chdir(curDir) != 0) {
-                // wipe workingDir to length of current contents, fill with cwd
-                memset(workingDir, '\0', strlen(workingDir));
-                getcwd(workingDir, sizeof(workingDir));
-                printf("No such directory: %s\n%s\n", ptr, workingDir);
-                fflush(stdout);
-                free(curDir);
-                return 1;
-            } else{
-                // wipe workingDir to length of current contents, fill with cwd
-                memset(workingDir, '\0', strlen(workingDir));
-                getcwd(workingDir, sizeof(workingDir));
-                printf("%s\n", workingDir);
-                fflush(stdout);
-                free(curDir);
-            }
+    // trailing newlines are dropped, as in sh
+    while (*outLen > start && (*out)[*outLen - 1] == '\n') {
+        (*outLen)--;
+    }
+    substituted = 1;
+    freePipeline(&sub);
+    arenaFree(&sub.arena);
+    free(line);
+}
+
+void appendBuffer(char **buf, size_t *len, size_t *cap, const char *data, size_t n) {
+    /*
+    Append bytes to a heap buffer, doubling it as needed
+    :param: buffer, its length and capacity, bytes to add, how many
+    */
+    if (*len + n > *cap) {
+        size_t newCap = *cap == 0 ? 4096 : *cap;
+        while (newCap < *len + n) {
+            newCap *= 2;
         }
-        return 1;
-    // handle status command
-    } else if (strncmp(token, "status", 6) == 0) {
-        printf("Exited with value %i\n", statusVar);
-        fflush(stdout);
-        return 1;
+        *buf = realloc(*buf, newCap);
+        *cap = newCap;
     }
-    return 0;
+    memcpy(*buf + *len, data, n);
+    *len += n;
 }
 
-int parseInput(char *commandLine, struct sh_command *newCommand) {
+int serverCapture(int *saved) {
     /*
-    Read user input and separate it into vars in the sh_command struct
-    :param: user input string, command struct
-    :retrn: passing built-in bool
-    // borrowed own code from previous movies.c and filesAndDirs.c
-    // newline removal introduced by https://stackoverflow.com/questions/16677800/strtok-not-discarding-the-newline-character
+    Point the shell's stdout at the server's scratch memfd, so messages the shell prints while handling a
+    request (parse errors, builtins, commands that could not start) go back to the client
+    :param: where to keep the real stdout
+    :retrn: 0 on success, -1 when stdout is left alone
     */
+    if (serverScratch == -1) {
+        serverScratch = memfd_create("smallsh-reply", MFD_CLOEXEC);
+        if (serverScratch == -1) {
+            return -1;
+        }
+    }
+    // fd 1 shares the memfd's offset, both go back to the start
+    ftruncate(serverScratch, 0);
+    lseek(serverScratch, 0, SEEK_SET);
+    fflush(stdout);
+    *saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(serverScratch, STDOUT_FILENO);
+    return 0;
+}
 
-    // use temp array to prevent altering original input
-    char temp[2049];
-    // iterator for arg array
-    int i = 0;
+void serverRelease(int saved, struct sh_client *client) {
+    /*
+    Put the real stdout back and append what was written meanwhile to the client's output
+    :param: saved stdout from serverCapture, client
+    */
+    char buf[4096];
+    ssize_t got;
+    off_t offset = 0;
 
-    // wipe temp to ensure clear memory block
-    memset(temp, '\0', sizeof(temp));
-    strcpy(temp, commandLine);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    while ((got = pread(serverScratch, buf, sizeof(buf), offset)) > 0) {
+        appendBuffer(&client->out, &client->outLen, &client->outCap, buf, got);
+        offset += got;
+    }
+}
 
-    // tokenizing pointer
-    char *curptr = temp;
+void serverReply(struct sh_client *client, int waitStatus) {
+    /*
+    Queue the reply to the finished request: "exit N LENGTH\n" or "signal N LENGTH\n", then the captured stdout
+    :param: client, wait status of the request
+    */
+    char header[64];
+    int n;
 
-    // remove newline from fgets string
-    char *removeThis = strchr(temp, '\n');
-    if (removeThis != NULL) {
-        *removeThis = '\0';
+    if (WIFSIGNALED(waitStatus)) {
+        client->status = WTERMSIG(waitStatus);
+        n = snprintf(header, sizeof(header), "signal %d %zu\n", client->status, client->outLen);
+    } else {
+        client->status = WEXITSTATUS(waitStatus);
+        n = snprintf(header, sizeof(header), "exit %d %zu\n", client->status, client->outLen);
     }
+    client->timedOut = 0;
+    client->replyLen = 0;
+    client->replySent = 0;
+    appendBuffer(&client->reply, &client->replyLen, &client->replyCap, header, n);
+    appendBuffer(&client->reply, &client->replyLen, &client->replyCap, client->out, client->outLen);
+    client->outLen = 0;
+}
+
+void serverStart(int epfd, struct sh_client *client, char *line) {
+    /*
+    Run one request line through the shell's own parse, builtin, and launch path. Builtins and failures are
+    answered at once, commands become a job whose stdout is read through a pipe until it is reaped. Lists,
+    other compiled lines and lines with $(...) run as one job in a copy of the shell, and builtins that wait are
+    refused, so no request holds up the event loop
+    :param: epoll instance, client, request line (modified)
+    */
+    static char *blocking[] = {"wait", "fg", "parallel", NULL};
+    struct sh_pipeline *pipeline = &client->pipeline;
+    int viaCopy = compoundLine(line) == 1 || strstr(line, "$(") != NULL;
+    char **word;
+    pid_t pgid;
+    int saved;
+    int fds[2];
 
-    // change $$ to PID and fill temp array
-    while (strstr(temp, "$$")) {
-        insertPID(temp);
+    statusVar = client->status;
+    statusTimedOut = client->timedOut;
+    freePipeline(pipeline);
+    if (serverCapture(&saved) == -1) {
+        serverReply(client, W_EXITCODE(1, 0));
+        return;
     }
 
-    // collect first token
-    char* token = strtok_r(curptr, " ", &curptr);
+    // rejected line
+    if (viaCopy == 0 && parseInput(line, pipeline) == -1) {
+        serverRelease(saved, client);
+        serverReply(client, W_EXITCODE(1, 0));
+        return;
+    }
+    // nothing but blanks keeps the old status
+    if (viaCopy == 0 && pipeline->first->argc == 0) {
+        serverRelease(saved, client);
+        serverReply(client, W_EXITCODE(client->status, 0));
+        return;
+    }
+    if (viaCopy == 0 && stripPrefixes(pipeline) == -1) {
+        serverRelease(saved, client);
+        serverReply(client, W_EXITCODE(1, 0));
+        return;
+    }
+    // the server can't sit in a builtin until some job finishes
+    for (word = blocking; viaCopy == 0 && *word != NULL; word++) {
+        if (strcmp(pipeline->first->args[0], *word) == 0) {
+            printf("%s: not available over the server socket\n", *word);
+            serverRelease(saved, client);
+            serverReply(client, W_EXITCODE(1, 0));
+            return;
+        }
+    }
+    // built-ins run right here, exit ends only this connection
+    if (viaCopy == 0 && checkBuiltIns(pipeline->first) == 1) {
+        serverRelease(saved, client);
+        if (to_exit == 1) {
+            to_exit = 0;
+            client->closing = 1;
+        }
+        serverReply(client, W_EXITCODE(statusVar & 0xff, 0));
+        client->timedOut = statusTimedOut;
+        return;
+    }
 
-    // check for built-in functions
-    if (checkBuiltIns(temp, token, curptr) == 1) {
-        // special case handled, end parsing
-        return 1;
+    // the last stage writes into our pipe, the first reads nothing unless told to
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("Cannot create pipe");
+        serverRelease(saved, client);
+        serverReply(client, W_EXITCODE(1, 0));
+        return;
+    }
+    pid_t *pids = malloc((viaCopy == 1 ? 1 : pipeline->count) * sizeof(pid_t));
+    if (viaCopy == 1) {
+        pipeline->text = line;
+        pipeline->count = 1;
+        pgid = pids[0] = shellCopy(line, fds[1], nullFD());
+    } else {
+        pipeline->captureFD = fds[1];
+        pipeline->background = 0;
+        pipeline->inputFD = nullFD();
+        pgid = launchPipeline(pipeline, pids);
     }
+    close(fds[1]);
+    serverRelease(saved, client);
 
-    // allocate and fill command memory
-    newCommand->command = calloc(strlen(token) + 1, sizeof(char));
-    strcpy(newCommand->command, token);
-    // allocate and fill first arg with command
-    newCommand->args[i] = calloc(strlen(token) + 1, sizeof(char));
-    strcpy(newCommand->args[i], token);
-    i++;
+    if (pgid == -1) {
+        close(fds[0]);
+        free(pids);
+        serverReply(client, W_EXITCODE(1, 0));
+        return;
+    }
+    client->job = addJob(pgid, pids, pipeline->count, pipeline);
+    free(pids);
 
-    // check each token for input, output, and background indications
-    do {
-        // set input indicated
-        if (curptr[0] == '<' && curptr[1] == ' ') {
-            // ignore special symbol
-            token = strtok_r(curptr, " ", &curptr);
-            // collect, allocate for, and store input location
-            token = strtok_r(curptr, " ", &curptr);
-            newCommand->inputFile = calloc(strlen(token) + 1, sizeof(char));
-            strcpy(newCommand->inputFile, token);
-            // toggle redir bool
-            redirInput = 1;
-
-        // set output indicated
-        } else if (curptr[0] == '>' && curptr[1] == ' ') {
-            // ignore special symbol
-            token = strtok_r(curptr, " ", &curptr);
-            // collect, allocate for, and store output location
-            token = strtok_r(curptr, " ", &curptr);
-            newCommand->outputFile = calloc(strlen(token) + 1, sizeof(char));
-            strcpy(newCommand->outputFile, token);
-            // toggle redir bool
-            redirOutput = 1;
-
-        // send to background indicated
-        } else if (curptr[0] == '&' && curptr[1] == '\0') {
-            // make it a background process
-            if (allow_bg == 0) {
-                newCommand->background = 1;
-            }
-            break;
+    struct epoll_event ev = {0};
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    client->outFD = fds[0];
+    ev.events = EPOLLIN;
+    ev.data.ptr = &client->outTag;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, client->outFD, &ev);
+}
 
-        // end of command
-        } else if (curptr[0] == '\0') {
-            break;
+void serverDrop(int epfd, struct sh_client *client) {
+    /*
+    Close a connection and release everything it holds
+    :param: epoll instance, client
+    */
+    struct sh_client **link = &serverClients;
 
-        // no special symbols encountered, collect, allocate for, and store command arg
-        } else {
-            token = strtok_r(curptr, " ", &curptr);
-            newCommand->args[i] = calloc(strlen(token) + 1, sizeof(char));
-            strcpy(newCommand->args[i], token);
-            i++;
-        }
-    // loop until curptr finds null char
-    } while (curptr[0] != '\0');
-    // indicate no built-ins encountered
-    return 0;
+    while (*link != client) {
+        link = &(*link)->next;
+    }
+    *link = client->next;
+    close(client->fd);
+    arenaFree(&client->pipeline.arena);
+    free(client->in);
+    free(client->out);
+    free(client->reply);
+    free(client);
 }
 
-void printCommand(struct sh_command *command) {
+void serverAdvance(int epfd, struct sh_client *client) {
     /*
-    Non-vital function for debugging purposes - prints command struct vars
-    :param: command struct
+    Move a client along as far as it can go without blocking: send the pending reply, finish a reaped job,
+    then start the next complete request line. Requests from one client run in order
+    :param: epoll instance, client
     */
-    printf("# DEBUG INFO #\n--- Command: %s\n", command->command);
-    fflush(stdout);
-    int i = 0;
-    while (command->args[i] != NULL) {
-        printf("--- arg: %s\n", command->args[i]);
-        fflush(stdout);
-        i++;
+    struct epoll_event ev = {0};
+
+    while (1) {
+        // pending reply first, waiting for EPOLLOUT when the socket is full
+        if (client->replySent < client->replyLen) {
+            ssize_t sent = send(client->fd, client->reply + client->replySent,
+                                client->replyLen - client->replySent, MSG_NOSIGNAL);
+            if (sent == -1 && errno != EAGAIN && errno != EINTR) {
+                client->closing = 1;
+                client->replyLen = 0;
+                client->replySent = 0;
+            } else if (sent > 0) {
+                client->replySent += sent;
+            }
+            if (client->replySent < client->replyLen) {
+                ev.events = EPOLLIN | EPOLLOUT;
+                ev.data.ptr = &client->sockTag;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev);
+                return;
+            }
+            ev.events = EPOLLIN;
+            ev.data.ptr = &client->sockTag;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev);
+        }
+
+        // a running request is finished once it is reaped and its output reached end of file
+        if (client->job != NULL) {
+            if (client->job->state != JOB_DONE || client->outFD != -1) {
+                return;
+            }
+            // a request cut off by its deadline answers 124, like status does in the shell
+            int timedOut = client->job->timedOut;
+            int waitStatus = timedOut == 1 ? W_EXITCODE(TIMEOUT_STATUS, 0) : client->job->status;
+            freeJob(client->job);
+            client->job = NULL;
+            if (client->closing == 0) {
+                serverReply(client, waitStatus);
+                client->timedOut = timedOut;
+            }
+            continue;
+        }
+
+        if (client->closing == 1) {
+            serverDrop(epfd, client);
+            return;
+        }
+
+        // next complete line
+        char *newline = client->inLen > 0 ? memchr(client->in, '\n', client->inLen) : NULL;
+        if (newline == NULL) {
+            return;
+        }
+        *newline = '\0';
+        size_t used = newline - client->in + 1;
+        if (newline > client->in && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        serverStart(epfd, client, client->in);
+        // the job keeps its own copy of the line, the words aren't needed once launched
+        memmove(client->in, client->in + used, client->inLen - used);
+        client->inLen -= used;
     }
-    printf("--- inputFile: %s\n", command->inputFile);
-    fflush(stdout);
-    printf("--- outputFile: %s\n", command->outputFile);
-    fflush(stdout);
-    printf("--- background: %i\n", command->background);
-    fflush(stdout);
-    printf("##############");
-    fflush(stdout);
 }
 
-void parSigStp(int signum) {
+void serverRead(int epfd, struct sh_client *client, int fromOutput) {
     /*
-    Signal catching function - activated on receipt of SIGTSTP command, prevents running background
-    :param: signal passed (unused)
+    Read what is ready on a client's socket (request lines) or on its running request's stdout pipe
+    :param: epoll instance, client, 1 for the stdout pipe
     */
-    // toggle allow-background bool, print message
-    if (allow_bg == 0) {
-        char *message = "\nEntering foreground-only mode (& is now ignored)\n";
-        write(STDOUT_FILENO, message, 50);
-        allow_bg = 1;
-    // toggle allow-background bool and print message
-    } else {
-        char *message = "\nExiting foreground-only mode\n";
-        write(STDOUT_FILENO, message, 30);
-        allow_bg = 0;
+    char buf[16384];
+    ssize_t got;
+    int fd = fromOutput == 1 ? client->outFD : client->fd;
+
+    while ((got = read(fd, buf, sizeof(buf))) > 0) {
+        if (fromOutput == 1) {
+            appendBuffer(&client->out, &client->outLen, &client->outCap, buf, got);
+        } else {
+            appendBuffer(&client->in, &client->inLen, &client->inCap, buf, got);
+        }
+    }
+    if (got == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    // end of file
+    if (fromOutput == 1) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, client->outFD, NULL);
+        close(client->outFD);
+        client->outFD = -1;
+    } else if (client->closing == 0) {
+        // hung up - stop listening, kill what it was running, and go once the job is reaped
+        epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+        client->closing = 1;
+        client->inLen = 0;
+        if (client->job != NULL) {
+            killpg(client->job->pgid, SIGKILL);
+        }
     }
 }
 
-int main(int argc, char *argv[]) {
+int serverLoop(char *path) {
+    /*
+    Server mode - listen on a Unix socket and run command lines from any number of clients, multiplexed with
+    epoll together with the SIGCHLD signalfd. Each line is answered with its status and captured stdout
+    :param: socket path
+    :retrn: exit status for main
+    */
+    struct sockaddr_un addr = {0};
+    struct server_tag listenTag = {TAG_LISTEN, NULL};
+    struct server_tag childTag = {TAG_CHILD, NULL};
+    struct server_tag deadlineTag = {TAG_DEADLINE, NULL};
+    struct epoll_event ev = {0};
+    struct epoll_event events[64];
+    int listenFD;
+    int epfd;
+    int i;
 
-    // signal handling for parent
-    struct sigaction parIgnore_SIGINT = {0};
-    // ignore other incoming signals
-    sigfillset(&parIgnore_SIGINT.sa_mask);
-    // send to terminating function
-    parIgnore_SIGINT.sa_handler = SIG_IGN;
-    // don't flag anything
-    parIgnore_SIGINT.sa_flags = 0;
-    // set handler on SIGINT
-    sigaction(SIGINT, &parIgnore_SIGINT, NULL);
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return EXIT_FAILURE;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    listenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    // a socket file left behind by an earlier server is replaced
+    unlink(path);
+    if (listenFD == -1 || bind(listenFD, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listenFD, SOMAXCONN) == -1) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
 
-    // SIGSTP handling for foreground children
-    struct sigaction catch_SIGTSTP = {0};
-    // ignore other incoming signals
-    sigfillset(&catch_SIGTSTP.sa_mask);
-    // send to terminating function
-    catch_SIGTSTP.sa_handler = parSigStp;
-    // don't flag anything
-    catch_SIGTSTP.sa_flags = 0;
-    // set handler on catch_SIGTSTP
-    sigaction(SIGTSTP, &catch_SIGTSTP, NULL);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listenTag;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listenFD, &ev);
+    ev.data.ptr = &childTag;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, childFD, &ev);
+    // job deadlines fire through the same loop, the timer is only armed while one is pending
+    if (deadlineTimer() != -1) {
+        ev.data.ptr = &deadlineTag;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, deadlineFD, &ev);
+    }
 
     while (1) {
+        int ready = epoll_wait(epfd, events, 64, -1);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return EXIT_FAILURE;
+        }
 
-        pid_t checkAll;
-        // -1 checks for any finished children, waitpid returns > 0 when found, WNOHANG doesn't wait
-        while ((checkAll = waitpid(-1, &statusVar, WNOHANG)) > 0) {
-            // exited normally
-            if (WIFEXITED(statusVar)) {
-                // fix statusVar format
-                statusVar = WEXITSTATUS(statusVar);
-                // make sure process ending isn't a previously failed foreground process
-                if (checkAll != sigCaught) {
-                    printf("Background process %d ended, exit value %d\n", checkAll, statusVar);
-                    fflush(stdout);
-                // foreground process ending late
-                } else {
-                    // reset catch value to something that can't be returned by waitpid
-                    sigCaught = -2;
+        for (i = 0; i < ready; i++) {
+            struct server_tag *tag = events[i].data.ptr;
+
+            if (tag->kind == TAG_LISTEN) {
+                int fd;
+                while ((fd = accept4(listenFD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+                    struct sh_client *client = calloc(1, sizeof(struct sh_client));
+                    client->fd = fd;
+                    client->outFD = -1;
+                    client->sockTag.kind = TAG_CLIENT;
+                    client->sockTag.client = client;
+                    client->outTag.kind = TAG_OUTPUT;
+                    client->outTag.client = client;
+                    client->next = serverClients;
+                    serverClients = client;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = &client->sockTag;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
                 }
-            // terminated abnormally
-            } else {
-                // fix statusVar format
-                statusVar = WTERMSIG(statusVar);
-                printf("Background process %d ended, terminated with signal %d\n", checkAll, statusVar);
-                fflush(stdout);
+            } else if (tag->kind == TAG_CHILD) {
+                // signalfd coalesces SIGCHLDs, drain it and let wait4 find every changed child
+                struct signalfd_siginfo info;
+                while (read(childFD, &info, sizeof(info)) == sizeof(info));
+                reapChildren();
+            } else if (tag->kind == TAG_DEADLINE) {
+                expireDeadlines();
+            } else if (tag->kind == TAG_OUTPUT) {
+                serverRead(epfd, tag->client, 1);
+            } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                serverRead(epfd, tag->client, 0);
             }
         }
 
-        // send empty prompt to terminal
-        printf(": ");
-        fflush(stdout);
+        // one pass over the clients after the batch, so a client dropped above is never touched twice
+        struct sh_client *client = serverClients;
+        while (client != NULL) {
+            struct sh_client *next = client->next;
+            serverAdvance(epfd, client);
+            client = next;
+        }
+        // requests launched or reaped above move the nearest deadline
+        armDeadlines();
+    }
+}
 
-        // allocate memory for command struct with main scope and clear it
-        struct sh_command *newCommand = malloc(sizeof(struct sh_command));
-        clearCommand(newCommand);
-        newCommand->background = 0;
+int main(int argc, char *argv[]) {
 
-        // clear input buffer, reset redirect bools, and receive user command - 2049 chars
-        memset(sh_input, '\0', sizeof(sh_input));
-        redirOutput = 0;
-        redirInput = 0;
-        fgets(sh_input, 2049, stdin);
+    struct line_reader reader;
+    char *scriptFile = NULL;
+    char *commandText = NULL;
+    char *traceName = NULL;
+    char *serverPath = NULL;
 
-        // check for blankline/comment prior to parsing
-        if (noComment() == 0) {
+    // read startup options
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--spawn=", 8) == 0 && setSpawnMode(argv[i] + 8) == 0) {
             continue;
         }
-
-        // prevent segfault when catching SIGTSTP (i.e. fgets exited early)
-        if (sh_input[0] == '\0') {
-            free(newCommand);
+        // --trace[=file] writes a JSON line per command
+        if (strcmp(argv[i], "--trace") == 0 || strncmp(argv[i], "--trace=", 8) == 0) {
+            traceName = argv[i][7] == '=' ? argv[i] + 8 : "smallsh.trace";
             continue;
         }
-
-        // caught a built-in
-        if (parseInput(sh_input, newCommand) == 1){
-            // look for exit bool
-            if (to_exit == 1) {
-                // terminate processes in process group
-                killpg(0, SIGTERM);
-                return EXIT_SUCCESS;
-            }
+        // --max-jobs=N queues & jobs beyond N running
+        if (strncmp(argv[i], "--max-jobs=", 11) == 0 && argv[i][11] >= '0' && argv[i][11] <= '9') {
+            maxJobs = atoi(argv[i] + 11);
+            continue;
+        }
+        // --bg-output=capture keeps & job output for the output builtin
+        if (strcmp(argv[i], "--bg-output=capture") == 0 || strcmp(argv[i], "--bg-output=discard") == 0) {
+            bgOutput = argv[i][12] == 'c' ? BGOUT_CAPTURE : BGOUT_DISCARD;
+            continue;
+        }
+        // --deadline=DURATION times out every job after DURATION
+        if (strncmp(argv[i], "--deadline=", 11) == 0 && parseDuration(argv[i] + 11) >= 0) {
+            defaultDeadline = parseDuration(argv[i] + 11);
+            continue;
+        }
+        // --server=path takes command lines from clients on a Unix socket
+        if (strncmp(argv[i], "--server=", 9) == 0 && argv[i][9] != '\0' && commandText == NULL && scriptFile == NULL) {
+            serverPath = argv[i] + 9;
+            continue;
+        }
+        // -c runs the given command text instead of reading input
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && commandText == NULL && scriptFile == NULL &&
+            serverPath == NULL) {
+            commandText = argv[++i];
+            continue;
+        }
+        // first plain argument is a script to run
+        if (argv[i][0] != '-' && commandText == NULL && scriptFile == NULL && serverPath == NULL) {
+            scriptFile = argv[i];
             continue;
         }
+        fprintf(stderr, "usage: %s [--spawn=fork|posix] [--trace[=file]] [--max-jobs=N] [--bg-output=capture|discard] [--deadline=DURATION] [--server=socket | -c command | script]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
 
-        // below developed with guidance from http://faculty.cs.niu.edu/~hutchins/csci480/forkexm1.htm and Creating and Terminating Processes Exploration and https://stackoverflow.com/questions/7155810/example-of-waitpid-wnohang-and-sigchld and https://linux.die.net/man/2/waitpid
+    if (traceName != NULL) {
+        traceFile = fopen(traceName, "we");
+        if (traceFile == NULL) {
+            fprintf(stderr, "Cannot open %s for trace output\n", traceName);
+            return EXIT_FAILURE;
+        }
+    }
 
-        // create child process and begin fork
-        pid_t childPID;
-        childPID = fork();
+    // descriptors children get copies of are opened once, close-on-exec
+    nullFD();
 
-        // evaluate fork
-        switch (childPID) {
-            // failed fork
-            case -1:
-                perror("The fork was unsuccessful.\n");
-                exit(1);
-                break;
-            // '{}' for '0' case establish a scope for the child process to allow struct declaration
-            // successful fork
-            case 0: {
-                // guidance from Processes and I/O, and Signal Handling Explorations 
-
-                // SIGTSTP handling for foreground children
-                struct sigaction catch_SIGTSTP = {0};
-                // ignore other incoming signals
-                sigfillset(&catch_SIGTSTP.sa_mask);
-                // send to terminating function
-                catch_SIGTSTP.sa_handler = SIG_IGN;
-                // don't flag anything
-                catch_SIGTSTP.sa_flags = 0;
-                // set handler on catch_SIGTSTP
-                sigaction(SIGTSTP, &catch_SIGTSTP, NULL);
-
-                // check input redirection bool
-                if (redirInput == 1) {
-                    // open file in readonly
-                    int inRedir = open(newCommand->inputFile, O_RDONLY);
-                    // failed open
-                    if (inRedir == -1) {
-                        printf("Cannot open %s for input\n", newCommand->inputFile);
-                        fflush(stdout);
-                        exit(1);
-                    }
-                    // change stdin to file path
-                    int redirectDup = dup2(inRedir, 0);
-                    // failed dup
-                    if (redirectDup == -1) {
-                        printf("Cannot redirect stdin to %s\n", newCommand->inputFile);
-                        fflush(stdout);
-                        exit(1);
-                    }
-                    // close input file
-                    close(inRedir);
-                }
+    // pick the input source
+    if (commandText != NULL) {
+        initStringReader(&reader, commandText);
+    } else if (scriptFile != NULL) {
+        int scriptFD = open(scriptFile, O_RDONLY | O_CLOEXEC);
+        if (scriptFD == -1) {
+            fprintf(stderr, "Cannot open %s for input\n", scriptFile);
+            return EXIT_FAILURE;
+        }
+        initReader(&reader, scriptFD);
+    } else {
+        initReader(&reader, STDIN_FILENO);
+    }
+    shellInput = &reader;
+    // prompts only make sense when a person is typing the input
+    showPrompt = reader.fd != -1 && isatty(reader.fd);
 
-                // check input redirection bool
-                if (redirOutput == 1) {
-                    // open file for writing: create if necessary, truncate if exists
-                    int outRedir = open(newCommand->outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                    // failed open
-                    if (outRedir == -1) {
-                        printf("Cannot open %s for output\n", newCommand->outputFile);
-                        fflush(stdout);
-                        exit(1);
-                    }
-                    // change stdout to file path via dup2
-                    int redirOutDup = dup2(outRedir, 1);
-                    // failed dup
-                    if (redirOutDup == -1) {
-                        printf("Cannot redirect stdout to %s\n", newCommand->outputFile);
-                        fflush(stdout);
-                        exit(1);
-                    }
-                    // close file
-                    close(outRedir);
-                }
+    // hand the terminal to foreground jobs only when the shell owns it
+    shellPGID = getpgrp();
+    if (serverPath == NULL && isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == shellPGID) {
+        jobControl = 1;
+    }
 
-                // check background process bool
-                if (newCommand->background == 1) {
-                    // SIGINT handling for background children
-                    struct sigaction bgIgnore_SIGINT = {0};
-                    // ignore other incoming signals
-                    sigfillset(&bgIgnore_SIGINT.sa_mask);
-                    // send to terminating function
-                    bgIgnore_SIGINT.sa_handler = SIG_IGN;
-                    // don't flag anything
-                    bgIgnore_SIGINT.sa_flags = 0;
-                    // set handler on SIGINT
-                    sigaction(SIGINT, &bgIgnore_SIGINT, NULL);
-
-                    // open null for writing
-                    int bgRedir = open("/dev/null", O_WRONLY);
-                    // failed open
-                    if (bgRedir == -1) {
-                        printf("Cannot open /dev/null for output\n");
-                        fflush(stdout);
-                        exit(1);
-                    }
+    setupSignals();
+    // children see the directory we're really in
+    setenv("PWD", currentDir(), 1);
 
-                    // change stdout to null for void dump
-                    int redirBgDup = dup2(bgRedir, 1);
-                    // failed dup
-                    if (redirBgDup == -1) {
-                        printf("Cannot redirect stdout to /dev/null\n");
-                        fflush(stdout);
-                        exit(1);
-                    }
+    // clients bring their own command lines
+    if (serverPath != NULL) {
+        return serverLoop(serverPath);
+    }
 
-                    // close null for writing
-                    close(bgRedir);
+    struct sh_pipeline pipeline = {0};
+    shellName = scriptFile != NULL ? scriptFile : argv[0];
 
-                // foreground process handling
-                } else {
-                    // SIGINT handling for foreground children
-                    struct sigaction catch_SIGINT = {0};
-                    // ignore other incoming signals
-                    sigfillset(&catch_SIGINT.sa_mask);
-                    // send to terminating function
-                    catch_SIGINT.sa_handler = SIG_DFL;
-                    // don't flag anything
-                    catch_SIGINT.sa_flags = 0;
-                    // set handler on SIGINT
-                    sigaction(SIGINT, &catch_SIGINT, NULL);
-                }
-                execvp(newCommand->command, newCommand->args);
-                // failed exec command
-                printf("%s: no such file or directory\n", newCommand->command);
-                fflush(stdout);
-                exit(1);
+    while (1) {
+
+        // send empty prompt to terminal
+        if (showPrompt == 1) {
+            printf(": ");
+            fflush(stdout);
+        }
+
+        // receive user command
+        sh_input = readLine(&reader);
+
+        // end of input leaves like exit, without the farewell
+        if (sh_input == NULL) {
+            killJobs();
+            return statusVar;
+        }
+
+        // check for blankline/comment prior to parsing, also covers a read interrupted by SIGTSTP
+        if (noComment() == 0) {
+            continue;
+        }
+
+        // loops, ifs and function definitions are compiled whole, reading more lines as needed, then run
+        if (compoundLine(sh_input) == 1) {
+            runCompound(&reader, sh_input);
+            if (to_exit == 1) {
+                killJobs();
+                return statusVar;
             }
-            // parent resumption
-            default:
-                // foreground: wait for child and store statusVar
-                if (newCommand->background == 0) {
-                    pid_t newPID;
-                    newPID = waitpid(childPID, &statusVar, 0);
-                    // catch a foreground process terminating unsuccessfully
-                    if (newPID < 0) {
-                        sigCaught = childPID;
-                    }
-                    // evaluate child's exit
-                    if (WIFEXITED(statusVar)) {
-                        // format statusVar if exited successfully
-                        statusVar = WEXITSTATUS(statusVar);
-                    } else {
-                        // format statusVar if process terminated
-                        statusVar = WTERMSIG(statusVar);
-                        printf("Process %d ended, terminated with signal %d\n", newPID, statusVar);
-                        fflush(stdout);
-                    }
-                } else {
-                    // print background PID
-                    printf("Background PID is %d\n", childPID);
-                    fflush(stdout);
-                }
-                break;
+            continue;
+        }
+
+        // rejected line
+        if (parseInput(sh_input, &pipeline) == -1) {
+            freePipeline(&pipeline);
+            statusVar = 1;
+            continue;
+        }
+
+        // run it, then release allocated memory
+        execPipeline(&pipeline);
+        freePipeline(&pipeline);
+
+        // look for exit bool
+        if (to_exit == 1) {
+            // terminate background jobs
+            killJobs();
+            return statusVar;
         }
-        // release allocated memory
-        freeCommand(newCommand);
-        free(newCommand);
     }
-}
\ No newline at end of file
+}